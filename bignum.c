@@ -1,4 +1,9 @@
+#ifdef __KERNEL__
+#include <linux/bitops.h>
 #include <linux/slab.h>
+#else
+#include "compat/user.h"
+#endif
 
 #include "bignum.h"
 
@@ -564,6 +569,12 @@ bignum_t *bn_fibonacci_fd(long long n)
         }
     }
 
+    bn_free(&t0);
+    bn_free(&t1);
+    bn_free(&t4);
+    bn_free(&temp1);
+    bn_free(&temp2);
+
     return t3;
 
 bn_fib_fd_FAIL:
@@ -578,6 +589,121 @@ bn_fib_fd_FAIL:
     return NULL;
 }
 
+/* Fast doubling from the most significant bit down: level k holds F[m] and
+ * F[m+1] for m, the top k of the 63 bits of a number. Ascending numbers
+ * share the levels of their common binary prefix, so only the levels below
+ * it are computed again, and a number close to the previous one is reached
+ * with additions alone */
+int bn_fibonacci_batch(const long long *n,
+                       size_t cnt,
+                       int (*emit)(long long, bignum_t *, void *),
+                       void *data)
+{
+    bignum_t *f[64] = {NULL}, *f1[64] = {NULL};  // F[m], F[m+1] per level
+    bignum_t *temp1 = NULL, *temp2 = NULL, *temp3 = NULL;
+    long long chain = 0, top = 0;  // Numbers whose levels are stored
+    int k, lead, retn = 0;
+    size_t i;
+
+    for (i = 0; i < cnt; i++) {
+        /* Step from the last number while additions are cheaper than
+           the multiplications of the lower levels */
+        if (i && n[i] - top <= (long long) f[63]->cnt_d) {
+            while (top < n[i]) {
+                retn = bn_add(&temp1, f[63], f1[63]);
+                if (retn != 0)
+                    goto bn_fib_batch_END;
+
+                bn_free(&f[63]);
+                f[63] = f1[63];
+                f1[63] = temp1;
+                temp1 = NULL;
+                top++;
+            }
+        } else {
+            lead = 63 - fls64(n[i]);  // Leading zero bits
+            k = i ? 63 - fls64(n[i] ^ chain) : 0;
+
+            /* Nothing shared but the leading zeros, start from the top
+               bit set: F[1], F[2], or F[0], F[1] for zero */
+            if (k <= lead) {
+                k = lead < 63 ? lead + 1 : 63;
+
+                retn = bn_cast_from_ll(&f[k], n[i] ? 1 : 0);
+                if (retn != 0)
+                    goto bn_fib_batch_END;
+
+                retn = bn_cast_from_ll(&f1[k], 1);
+                if (retn != 0)
+                    goto bn_fib_batch_END;
+            }
+
+            for (; k < 63; k++) {
+                /* Perform temp1 = F[2m] = F[m] * (2 * F[m+1] - F[m]) */
+                retn = bn_add(&temp2, f1[k], f1[k]);
+                if (retn != 0)
+                    goto bn_fib_batch_END;
+
+                retn = bn_sub_for_fib(&temp2, temp2, f[k]);
+                if (retn != 0)
+                    goto bn_fib_batch_END;
+
+                retn = bn_mul(&temp1, f[k], temp2);
+                if (retn != 0)
+                    goto bn_fib_batch_END;
+
+                /* Perform temp2 = F[2m+1] = F[m] * F[m] + F[m+1] * F[m+1] */
+                retn = bn_mul(&temp2, f[k], f[k]);
+                if (retn != 0)
+                    goto bn_fib_batch_END;
+
+                retn = bn_mul(&temp3, f1[k], f1[k]);
+                if (retn != 0)
+                    goto bn_fib_batch_END;
+
+                retn = bn_add(&temp2, temp2, temp3);
+                if (retn != 0)
+                    goto bn_fib_batch_END;
+
+                bn_free(&f[k + 1]);
+                bn_free(&f1[k + 1]);
+                if ((n[i] >> (62 - k)) & 1) {
+                    /* Next bit set: F[2m+1], F[2m+2] */
+                    retn = bn_add(&temp3, temp1, temp2);
+                    if (retn != 0)
+                        goto bn_fib_batch_END;
+
+                    f[k + 1] = temp2;
+                    f1[k + 1] = temp3;
+                    temp2 = temp3 = NULL;
+                } else {
+                    f[k + 1] = temp1;
+                    f1[k + 1] = temp2;
+                    temp1 = temp2 = NULL;
+                }
+            }
+            chain = n[i];
+        }
+        top = n[i];
+
+        retn = emit(n[i], f[63], data);
+        if (retn != 0)
+            goto bn_fib_batch_END;
+    }
+
+bn_fib_batch_END:
+
+    for (k = 0; k < 64; k++) {
+        bn_free(&f[k]);
+        bn_free(&f1[k]);
+    }
+    bn_free(&temp1);
+    bn_free(&temp2);
+    bn_free(&temp3);
+
+    return retn;
+}
+
 
 //----------------------------------------------------------------
 // Big number service operation
@@ -59,6 +59,13 @@ bignum_t *bn_fibonacci(long long);
 /* Return fibonacci number via fast doubling method */
 bignum_t *bn_fibonacci_fd(long long);
 
+/* Hand the fibonacci numbers of ascending, distinct, non-negative n[] to
+ * emit() one by one, sharing the work between them */
+int bn_fibonacci_batch(const long long *,
+                       size_t,
+                       int (*)(long long, bignum_t *, void *),
+                       void *);
+
 //----------------------------------------------------------------
 // Big number service operation
 
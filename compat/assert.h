@@ -1,6 +1,10 @@
 #ifndef COMPAT_ASSERT_H
 #define COMPAT_ASSERT_H
 
+#ifdef __KERNEL__
 static inline void assert(int x) {};
+#else
+#include <assert.h>
+#endif
 
 #endif
@@ -1 +1,4 @@
 /* Dummy */
+#ifndef __KERNEL__
+#include <ctype.h>
+#endif
@@ -1,2 +1,6 @@
+#ifdef __KERNEL__
 #include <linux/types.h>
 #include <linux/kernel.h>
+#else
+#include <stddef.h>
+#endif
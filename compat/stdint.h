@@ -1 +1,4 @@
 /* Dummy */
+#ifndef __KERNEL__
+#include <stdint.h>
+#endif
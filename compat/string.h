@@ -1,2 +1,6 @@
+#ifdef __KERNEL__
 #include <linux/string.h>
 #include <linux/memory.h>
+#else
+#include <string.h>
+#endif
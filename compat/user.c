@@ -0,0 +1,121 @@
+/*
+ * The parts of khttpd the userspace build leaves out, see compat/user.h:
+ * nothing is cached, no files are served and nothing is proxied. Requests
+ * are neither accounted, logged, rate limited nor timed out.
+ */
+
+#include "compat/user.h"
+
+#include "http_cache.h"
+#include "http_file.h"
+#include "http_limit.h"
+#include "http_log.h"
+#include "http_proxy.h"
+#include "http_stats.h"
+#include "http_timer.h"
+
+struct http_cache_entry *http_cache_lookup(long long key)
+{
+    return NULL;
+}
+
+/* Uncacheable, the caller keeps sending its own copy of the body */
+struct http_cache_entry *http_cache_insert(long long key,
+                                           const char *body,
+                                           size_t size)
+{
+    return NULL;
+}
+
+void http_cache_get(struct http_cache_entry *entry) {}
+
+void http_cache_put(struct http_cache_entry *entry) {}
+
+bool http_file_enabled(void)
+{
+    return false;
+}
+
+struct http_file *http_file_lookup(const char *path, size_t len)
+{
+    return ERR_PTR(-ENOENT);
+}
+
+void http_file_get(struct http_file *file) {}
+
+void http_file_put(struct http_file *file) {}
+
+bool http_limit_accept(struct socket *socket, struct http_client **client)
+{
+    *client = NULL;
+    return true;
+}
+
+void http_limit_put(struct http_client *client) {}
+
+bool http_limit_charge(struct http_client *client, u64 cost)
+{
+    return true;
+}
+
+bool http_log_enabled(void)
+{
+    return false;
+}
+
+void http_log_write(struct http_log_record *record) {}
+
+bool http_proxy_enabled(void)
+{
+    return false;
+}
+
+int http_proxy_forward(struct socket *client,
+                       const char *url,
+                       size_t url_len,
+                       const char *headers,
+                       char *buf,
+                       size_t size,
+                       bool http11,
+                       bool *keep_alive,
+                       bool *sent)
+{
+    *sent = false;
+    return -EOPNOTSUPP;
+}
+
+void http_stats_count(enum http_counter counter) {}
+
+void http_stats_request(enum http_route route) {}
+
+void http_stats_error(enum http_route route) {}
+
+void http_stats_record(enum http_route route, enum http_stage stage, u64 ns)
+{
+}
+
+char *http_stats_format(size_t *len)
+{
+    char *stats = kstrdup("{}\n", GFP_KERNEL);
+
+    *len = stats ? strlen(stats) : 0;
+    return stats;
+}
+
+void http_timer_init(struct http_timer *timer,
+                     void (*function)(struct http_timer *timer))
+{
+    timer->evicted = false;
+    timer->function = function;
+}
+
+void http_timer_arm(struct http_timer *timer, unsigned long timeout, bool idle)
+{
+}
+
+void http_timer_del(struct http_timer *timer) {}
+
+bool http_timer_evict_idle(void)
+{
+    return false;
+}
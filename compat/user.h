@@ -0,0 +1,638 @@
+#ifndef COMPAT_USER_H
+#define COMPAT_USER_H
+
+/*
+ * The kernel API khttpd builds on, over libc and pthreads, for the userspace
+ * build (make khttpd-user). Only what the request path needs is here:
+ * - sockets are file descriptors, kernel_sendmsg() is sendmsg()
+ * - spinlocks and mutexes are pthread mutexes
+ * - RCU readers are free: handlers are registered before threads start
+ * - work items run inline, in the thread that queues them
+ * Nothing is ever unloaded, so module references always succeed.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifndef KBUILD_MODNAME
+#define KBUILD_MODNAME "khttpd"
+#endif
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t s64;
+typedef unsigned int gfp_t;
+
+#define U32_MAX UINT32_MAX
+#define U64_MAX UINT64_MAX
+
+#define GFP_KERNEL 0U
+#define GFP_ATOMIC 0U
+#define __GFP_NOFAIL 0U
+
+#define __init
+#define __exit
+#define __rcu
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define HZ 100
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_SEC 1000000000ULL
+
+#ifndef pr_fmt
+#define pr_fmt(fmt) fmt
+#endif
+#define pr_err(fmt, ...) fprintf(stderr, pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_warn(fmt, ...) fprintf(stderr, pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_warn_ratelimited pr_warn
+#define pr_info(fmt, ...) fprintf(stderr, pr_fmt(fmt), ##__VA_ARGS__)
+
+#define container_of(ptr, type, member) \
+    ((type *) ((char *) (ptr) -offsetof(type, member)))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(type, a, b) min((type) (a), (type) (b))
+#define max_t(type, a, b) max((type) (a), (type) (b))
+#define struct_size(p, member, n) (sizeof(*(p)) + sizeof(*(p)->member) * (n))
+
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, val) __atomic_store_n(&(x), (val), __ATOMIC_RELAXED)
+#define smp_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, val) __atomic_store_n((p), (val), __ATOMIC_RELEASE)
+
+/* Error pointers */
+
+#define MAX_ERRNO 4095
+
+static inline void *ERR_PTR(long error)
+{
+    return (void *) error;
+}
+
+static inline long PTR_ERR(const void *ptr)
+{
+    return (long) ptr;
+}
+
+static inline bool IS_ERR(const void *ptr)
+{
+    return (unsigned long) ptr >= (unsigned long) -MAX_ERRNO;
+}
+
+static inline bool IS_ERR_OR_NULL(const void *ptr)
+{
+    return !ptr || IS_ERR(ptr);
+}
+
+/* Allocations */
+
+#define kmalloc(size, gfp) malloc(size)
+#define kzalloc(size, gfp) calloc(1, size)
+#define kcalloc(n, size, gfp) calloc(n, size)
+#define kmalloc_array(n, size, gfp) calloc(n, size)
+#define kvmalloc(size, gfp) malloc(size)
+#define kvmalloc_array(n, size, gfp) calloc(n, size)
+#define kfree(p) free((void *) (p))
+#define kvfree(p) free((void *) (p))
+#define kstrdup(s, gfp) strdup(s)
+
+static inline char *kasprintf(gfp_t gfp, const char *fmt, ...)
+{
+    va_list args;
+    char *s;
+    int ret;
+
+    va_start(args, fmt);
+    ret = vasprintf(&s, fmt, args);
+    va_end(args);
+    return ret < 0 ? NULL : s;
+}
+
+struct kmem_cache {
+    size_t size;
+};
+
+#define SLAB_HWCACHE_ALIGN 0UL
+
+static inline struct kmem_cache *kmem_cache_create(const char *name,
+                                                   size_t size,
+                                                   size_t align,
+                                                   unsigned long flags,
+                                                   void (*ctor)(void *))
+{
+    struct kmem_cache *cache = malloc(sizeof(*cache));
+
+    if (cache)
+        cache->size = size;
+    return cache;
+}
+
+#define kmem_cache_destroy(cache) free(cache)
+#define kmem_cache_alloc(cache, gfp) malloc((cache)->size)
+#define kmem_cache_alloc_node(cache, gfp, node) malloc((cache)->size)
+#define kmem_cache_free(cache, p) free(p)
+
+/* Strings */
+
+static inline int scnprintf(char *buf, size_t size, const char *fmt, ...)
+{
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = vsnprintf(buf, size, fmt, args);
+    va_end(args);
+    if (ret < 0 || !size)
+        return 0;
+    return (size_t) ret >= size ? (int) size - 1 : ret;
+}
+
+static inline char *skip_spaces(const char *s)
+{
+    while (isspace(*s))
+        s++;
+    return (char *) s;
+}
+
+static inline char *strnstr(const char *s1, const char *s2, size_t len)
+{
+    size_t l2 = strlen(s2);
+
+    for (; len >= l2; len--, s1++)
+        if (!memcmp(s1, s2, l2))
+            return (char *) s1;
+    return NULL;
+}
+
+static inline void sort(void *base,
+                        size_t num,
+                        size_t size,
+                        int (*cmp)(const void *, const void *),
+                        void (*swap)(void *, void *, int))
+{
+    qsort(base, num, size, cmp);
+}
+
+static inline void put_unaligned_le32(u32 val, void *p)
+{
+    u8 *b = p;
+
+    b[0] = val;
+    b[1] = val >> 8;
+    b[2] = val >> 16;
+    b[3] = val >> 24;
+}
+
+static inline void put_unaligned_be32(u32 val, void *p)
+{
+    u8 *b = p;
+
+    b[0] = val >> 24;
+    b[1] = val >> 16;
+    b[2] = val >> 8;
+    b[3] = val;
+}
+
+/* Bits and atomics */
+
+static inline int fls64(u64 x)
+{
+    return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+static inline unsigned long roundup_pow_of_two(unsigned long n)
+{
+    return n <= 1 ? 1 : 1UL << (sizeof(long) * 8 - __builtin_clzl(n - 1));
+}
+
+static inline void set_bit(long nr, unsigned long *addr)
+{
+    __atomic_fetch_or(addr, 1UL << nr, __ATOMIC_SEQ_CST);
+}
+
+static inline void clear_bit(long nr, unsigned long *addr)
+{
+    __atomic_fetch_and(addr, ~(1UL << nr), __ATOMIC_SEQ_CST);
+}
+
+static inline bool test_bit(long nr, const unsigned long *addr)
+{
+    return __atomic_load_n(addr, __ATOMIC_RELAXED) & (1UL << nr);
+}
+
+static inline bool test_and_set_bit(long nr, unsigned long *addr)
+{
+    return __atomic_fetch_or(addr, 1UL << nr, __ATOMIC_SEQ_CST) & (1UL << nr);
+}
+
+static inline bool test_and_clear_bit(long nr, unsigned long *addr)
+{
+    return __atomic_fetch_and(addr, ~(1UL << nr), __ATOMIC_SEQ_CST) &
+           (1UL << nr);
+}
+
+typedef struct {
+    int counter;
+} atomic_t;
+
+typedef struct {
+    long counter;
+} atomic_long_t;
+
+#define ATOMIC_INIT(i) {(i)}
+#define atomic_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define __atomic_op(v, op) \
+    __atomic_##op##_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_inc(v) ((void) __atomic_op(v, add))
+#define atomic_dec(v) ((void) __atomic_op(v, sub))
+#define atomic_inc_return(v) __atomic_op(v, add)
+#define atomic_dec_return(v) __atomic_op(v, sub)
+#define atomic_long_read atomic_read
+#define atomic_long_inc atomic_inc
+
+/* Locks */
+
+typedef pthread_mutex_t spinlock_t;
+
+#define DEFINE_SPINLOCK(x) spinlock_t x = PTHREAD_MUTEX_INITIALIZER
+#define spin_lock_init(lock) pthread_mutex_init(lock, NULL)
+#define spin_lock(lock) pthread_mutex_lock(lock)
+#define spin_unlock(lock) pthread_mutex_unlock(lock)
+#define spin_lock_bh spin_lock
+#define spin_unlock_bh spin_unlock
+
+struct mutex {
+    pthread_mutex_t lock;
+};
+
+#define DEFINE_MUTEX(x) struct mutex x = {PTHREAD_MUTEX_INITIALIZER}
+#define mutex_lock(m) pthread_mutex_lock(&(m)->lock)
+#define mutex_unlock(m) pthread_mutex_unlock(&(m)->lock)
+#define lockdep_is_held(m) 1
+
+#define rcu_read_lock() do { } while (0)
+#define rcu_read_unlock() do { } while (0)
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_dereference_protected(p, c) (p)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define synchronize_rcu() do { } while (0)
+
+struct kref {
+    int refcount;
+};
+
+static inline void kref_init(struct kref *kref)
+{
+    kref->refcount = 1;
+}
+
+static inline void kref_get(struct kref *kref)
+{
+    __atomic_add_fetch(&kref->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static inline int kref_put(struct kref *kref,
+                           void (*release)(struct kref *kref))
+{
+    if (__atomic_sub_fetch(&kref->refcount, 1, __ATOMIC_ACQ_REL))
+        return 0;
+    release(kref);
+    return 1;
+}
+
+/* Lists and hash tables */
+
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name) {&(name), &(name)}
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+    list->next = list->prev = list;
+}
+
+static inline void __list_link(struct list_head *entry,
+                               struct list_head *prev,
+                               struct list_head *next)
+{
+    next->prev = entry;
+    entry->next = next;
+    entry->prev = prev;
+    prev->next = entry;
+}
+
+static inline void list_add(struct list_head *entry, struct list_head *head)
+{
+    __list_link(entry, head, head->next);
+}
+
+static inline void list_add_tail(struct list_head *entry,
+                                 struct list_head *head)
+{
+    __list_link(entry, head->prev, head);
+}
+
+static inline void list_del(struct list_head *entry)
+{
+    entry->next->prev = entry->prev;
+    entry->prev->next = entry->next;
+    entry->next = entry->prev = NULL;
+}
+
+static inline void list_del_init(struct list_head *entry)
+{
+    list_del(entry);
+    INIT_LIST_HEAD(entry);
+}
+
+static inline void list_move(struct list_head *entry, struct list_head *head)
+{
+    list_del(entry);
+    list_add(entry, head);
+}
+
+static inline void list_move_tail(struct list_head *entry,
+                                  struct list_head *head)
+{
+    list_del(entry);
+    list_add_tail(entry, head);
+}
+
+static inline bool list_empty(const struct list_head *head)
+{
+    return head->next == head;
+}
+
+#define list_empty_careful(head) \
+    (__atomic_load_n(&(head)->next, __ATOMIC_ACQUIRE) == (head))
+
+static inline bool list_is_last(const struct list_head *entry,
+                                const struct list_head *head)
+{
+    return entry->next == head;
+}
+
+/* Insert the entries of @list between @prev and @next */
+static inline void __list_splice(const struct list_head *list,
+                                 struct list_head *prev,
+                                 struct list_head *next)
+{
+    if (list->next == list)
+        return;
+    list->next->prev = prev;
+    prev->next = list->next;
+    list->prev->next = next;
+    next->prev = list->prev;
+}
+
+static inline void list_splice(const struct list_head *list,
+                               struct list_head *head)
+{
+    __list_splice(list, head, head->next);
+}
+
+static inline void list_splice_tail(const struct list_head *list,
+                                    struct list_head *head)
+{
+    __list_splice(list, head->prev, head);
+}
+
+static inline void list_splice_init(struct list_head *list,
+                                    struct list_head *head)
+{
+    list_splice(list, head);
+    INIT_LIST_HEAD(list);
+}
+
+static inline void list_splice_tail_init(struct list_head *list,
+                                         struct list_head *head)
+{
+    list_splice_tail(list, head);
+    INIT_LIST_HEAD(list);
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_first_entry(head, type, member) \
+    list_entry((head)->next, type, member)
+#define list_last_entry(head, type, member) \
+    list_entry((head)->prev, type, member)
+#define list_next_entry(pos, member) \
+    list_entry((pos)->member.next, __typeof__(*(pos)), member)
+#define list_for_each(pos, head) \
+    for (pos = (head)->next; pos != (head); pos = pos->next)
+#define list_for_each_entry(pos, head, member)                    \
+    for (pos = list_first_entry(head, __typeof__(*pos), member); \
+         &pos->member != (head); pos = list_next_entry(pos, member))
+#define list_for_each_entry_safe(pos, n, head, member)            \
+    for (pos = list_first_entry(head, __typeof__(*pos), member), \
+        n = list_next_entry(pos, member);                         \
+         &pos->member != (head); pos = n, n = list_next_entry(n, member))
+
+struct hlist_node {
+    struct hlist_node *next, **pprev;
+};
+
+struct hlist_head {
+    struct hlist_node *first;
+};
+
+static inline void hlist_add_head(struct hlist_node *node,
+                                  struct hlist_head *head)
+{
+    node->next = head->first;
+    if (head->first)
+        head->first->pprev = &node->next;
+    head->first = node;
+    node->pprev = &head->first;
+}
+
+static inline void hlist_del(struct hlist_node *node)
+{
+    *node->pprev = node->next;
+    if (node->next)
+        node->next->pprev = node->pprev;
+    node->next = NULL;
+    node->pprev = NULL;
+}
+
+#define hlist_entry_safe(ptr, type, member) \
+    ((ptr) ? container_of(ptr, type, member) : NULL)
+#define hlist_for_each_entry(pos, head, member)                          \
+    for (pos = hlist_entry_safe((head)->first, __typeof__(*pos), member); \
+         pos;                                                            \
+         pos = hlist_entry_safe(pos->member.next, __typeof__(*pos), member))
+
+#define DEFINE_HASHTABLE(name, bits) struct hlist_head name[1 << (bits)]
+#define HASH_BITS(name) __builtin_ctz(ARRAY_SIZE(name))
+#define hash_min(val, bits) \
+    ((u32) (((u64) (val) *0x61C8864680B583EBULL) >> (64 - (bits))))
+#define hash_add(table, node, key) \
+    hlist_add_head(node, &table[hash_min(key, HASH_BITS(table))])
+#define hash_del(node) hlist_del(node)
+#define hash_for_each_possible(table, obj, member, key) \
+    hlist_for_each_entry(obj, &table[hash_min(key, HASH_BITS(table))], member)
+
+/* Modules, never unloaded here */
+
+struct module;
+
+#define THIS_MODULE ((struct module *) NULL)
+#define EXPORT_SYMBOL(sym)
+#define EXPORT_SYMBOL_GPL(sym)
+
+static inline bool try_module_get(struct module *module)
+{
+    return true;
+}
+
+static inline void module_put(struct module *module) {}
+
+/* Work runs inline, nobody ever waits for it */
+
+typedef struct {
+    int unused;
+} wait_queue_head_t;
+
+#define init_waitqueue_head(wq) ((void) (wq))
+#define wake_up(wq) ((void) (wq))
+
+struct work_struct {
+    void (*func)(struct work_struct *work);
+};
+
+struct workqueue_struct {
+    int unused;
+};
+
+#define WQ_UNBOUND 0U
+#define WQ_SYSFS 0U
+#define INIT_WORK(work, fn) ((work)->func = (fn))
+
+static inline struct workqueue_struct *alloc_workqueue(const char *name,
+                                                       unsigned int flags,
+                                                       int max_active)
+{
+    static struct workqueue_struct wq;
+
+    return &wq;
+}
+
+#define destroy_workqueue(wq) ((void) (wq))
+
+static inline bool queue_work_node(int node,
+                                   struct workqueue_struct *wq,
+                                   struct work_struct *work)
+{
+    work->func(work);
+    return true;
+}
+
+#define cpu_to_node(cpu) 0
+#define numa_node_id() 0
+
+static inline u64 ktime_get_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+struct timespec64 {
+    s64 tv_sec;
+    long tv_nsec;
+};
+
+/* Sockets are file descriptors */
+
+struct sock;
+struct page;
+struct file;
+struct task_struct;
+
+struct socket {
+    int fd;
+};
+
+struct kvec {
+    void *iov_base;
+    size_t iov_len;
+};
+
+/* Only the blocking mode queue is declared with it, never built here */
+#define DECLARE_KFIFO_PTR(fifo, type) type *fifo
+
+static inline int kernel_recvmsg(struct socket *sock,
+                                 struct msghdr *msg,
+                                 struct kvec *vec,
+                                 size_t num,
+                                 size_t size,
+                                 int flags)
+{
+    ssize_t ret;
+
+    msg->msg_iov = (struct iovec *) vec;
+    msg->msg_iovlen = num;
+    ret = recvmsg(sock->fd, msg, flags);
+    return ret < 0 ? -errno : (int) ret;
+}
+
+static inline int kernel_sendmsg(struct socket *sock,
+                                 struct msghdr *msg,
+                                 struct kvec *vec,
+                                 size_t num,
+                                 size_t size)
+{
+    ssize_t ret;
+
+    msg->msg_iov = (struct iovec *) vec;
+    msg->msg_iovlen = num;
+    ret = sendmsg(sock->fd, msg, msg->msg_flags | MSG_NOSIGNAL);
+    return ret < 0 ? -errno : (int) ret;
+}
+
+/* IPv4 only, like the listeners */
+static inline int kernel_getpeername(struct socket *sock,
+                                     struct sockaddr *addr)
+{
+    socklen_t len = sizeof(struct sockaddr_in);
+
+    return getpeername(sock->fd, addr, &len) ? -errno : (int) len;
+}
+
+static inline int kernel_sock_shutdown(struct socket *sock, int how)
+{
+    return shutdown(sock->fd, how) ? -errno : 0;
+}
+
+static inline void sock_release(struct socket *sock)
+{
+    close(sock->fd);
+    free(sock);
+}
+
+#endif
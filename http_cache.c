@@ -0,0 +1,253 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/crc32.h>
+#include <linux/gfp.h>
+#include <linux/hashtable.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/zlib.h>
+#include <linux/zutil.h>
+
+#include "http_cache.h"
+
+#define CACHE_HASH_BITS 10
+
+static DEFINE_HASHTABLE(cache_table, CACHE_HASH_BITS);
+static LIST_HEAD(cache_lru); /* most recently used first */
+static DEFINE_SPINLOCK(cache_lock);
+static size_t cache_budget, cache_used;
+
+/* One deflate workspace, compression only happens on insertion */
+static DEFINE_MUTEX(deflate_lock);
+static void *deflate_workspace;
+static size_t compress_threshold;
+
+static void http_cache_release(struct kref *ref)
+{
+    struct http_cache_entry *entry =
+        container_of(ref, struct http_cache_entry, ref);
+    unsigned int i;
+
+    for (i = 0; i < entry->nr_pages; i++)
+        put_page(entry->pages[i]);
+    if (entry->deflated)
+        http_cache_put(entry->deflated);
+    kfree(entry);
+}
+
+void http_cache_get(struct http_cache_entry *entry)
+{
+    kref_get(&entry->ref);
+}
+
+void http_cache_put(struct http_cache_entry *entry)
+{
+    kref_put(&entry->ref, http_cache_release);
+}
+
+static size_t http_cache_charge(const struct http_cache_entry *entry)
+{
+    return entry->size + (entry->deflated ? entry->deflated->size : 0);
+}
+
+/* Called with cache_lock held, drops the reference held by the cache */
+static void http_cache_unlink(struct http_cache_entry *entry)
+{
+    hash_del(&entry->node);
+    list_del(&entry->lru);
+    cache_used -= http_cache_charge(entry);
+    http_cache_put(entry);
+}
+
+static struct http_cache_entry *http_cache_find(long long key)
+{
+    struct http_cache_entry *entry;
+
+    hash_for_each_possible (cache_table, entry, node, key)
+        if (entry->key == key)
+            return entry;
+    return NULL;
+}
+
+struct http_cache_entry *http_cache_lookup(long long key)
+{
+    struct http_cache_entry *entry;
+
+    if (!READ_ONCE(cache_budget))
+        return NULL;
+
+    spin_lock(&cache_lock);
+    entry = http_cache_find(key);
+    if (entry) {
+        list_move(&entry->lru, &cache_lru);
+        http_cache_get(entry);
+    }
+    spin_unlock(&cache_lock);
+    return entry;
+}
+
+static struct http_cache_entry *http_cache_alloc(long long key,
+                                                 const char *body,
+                                                 size_t size)
+{
+    unsigned int i, nr_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+    struct http_cache_entry *entry;
+
+    entry = kzalloc(struct_size(entry, pages, nr_pages), GFP_KERNEL);
+    if (!entry)
+        return NULL;
+    kref_init(&entry->ref);
+    entry->key = key;
+    entry->size = size;
+
+    /* Copy the body once, every later hit is sent straight from here */
+    for (i = 0; i < nr_pages; i++) {
+        size_t off = (size_t) i << PAGE_SHIFT;
+        entry->pages[i] = alloc_page(GFP_KERNEL);
+        if (!entry->pages[i]) {
+            http_cache_put(entry);
+            return NULL;
+        }
+        entry->nr_pages++;
+        memcpy(page_address(entry->pages[i]), body + off,
+               min_t(size_t, PAGE_SIZE, size - off));
+    }
+    return entry;
+}
+
+/*
+ * Attach the raw deflate stream of @body to @entry, unless it would not be
+ * smaller or take more than @room bytes. Failing to compress is not an
+ * error, the body is then only ever sent as is.
+ */
+static void http_cache_deflate(struct http_cache_entry *entry,
+                               const char *body,
+                               size_t size,
+                               size_t room)
+{
+    size_t limit = min(size, room);
+    z_stream strm = {};
+    char *out;
+    int ret;
+
+    out = kvmalloc(limit, GFP_KERNEL);
+    if (!out)
+        return;
+
+    mutex_lock(&deflate_lock);
+    strm.workspace = deflate_workspace;
+    ret = zlib_deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                            -MAX_WBITS, DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+    if (ret == Z_OK) {
+        strm.next_in = body;
+        strm.avail_in = size;
+        strm.next_out = out;
+        strm.avail_out = limit;
+        ret = zlib_deflate(&strm, Z_FINISH);
+        zlib_deflateEnd(&strm);
+    }
+    mutex_unlock(&deflate_lock);
+
+    /* Z_OK here means the output did not fit, no gain in compressing */
+    if (ret == Z_STREAM_END && strm.total_out < size) {
+        entry->deflated = http_cache_alloc(entry->key, out, strm.total_out);
+        entry->crc32 = crc32_le(~0, body, size) ^ ~0;
+        entry->adler32 = zlib_adler32(1, body, size);
+    }
+    kvfree(out);
+}
+
+struct http_cache_entry *http_cache_insert(long long key,
+                                           const char *body,
+                                           size_t size)
+{
+    size_t charge, threshold = READ_ONCE(compress_threshold);
+    size_t budget = READ_ONCE(cache_budget);
+    struct http_cache_entry *entry, *old;
+
+    if (!size || size > budget)
+        return NULL;
+
+    entry = http_cache_alloc(key, body, size);
+    if (!entry)
+        return NULL;
+    /* The deflated variant is charged too, it must fit next to the body */
+    if (READ_ONCE(deflate_workspace) && threshold && size >= threshold &&
+        size < budget)
+        http_cache_deflate(entry, body, size, budget - size);
+    charge = http_cache_charge(entry);
+
+    spin_lock(&cache_lock);
+    /* The cache shrank meanwhile, the entry no longer fits at all */
+    if (charge > cache_budget) {
+        spin_unlock(&cache_lock);
+        http_cache_put(entry);
+        return NULL;
+    }
+    /* Another worker computed the same key meanwhile, keep the newest */
+    old = http_cache_find(key);
+    if (old)
+        http_cache_unlink(old);
+    while (cache_used + charge > cache_budget && !list_empty(&cache_lru))
+        http_cache_unlink(
+            list_last_entry(&cache_lru, struct http_cache_entry, lru));
+    hash_add(cache_table, &entry->node, key);
+    list_add(&entry->lru, &cache_lru);
+    cache_used += charge;
+    http_cache_get(entry);
+    spin_unlock(&cache_lock);
+    return entry;
+}
+
+int http_cache_init(size_t budget, size_t compress_min)
+{
+    cache_budget = budget;
+    cache_used = 0;
+    compress_threshold = compress_min;
+    if (!budget || !compress_min)
+        return 0;
+    deflate_workspace =
+        vmalloc(zlib_deflate_workspacesize(MAX_WBITS, DEF_MEM_LEVEL));
+    if (!deflate_workspace)
+        return -ENOMEM;
+    return 0;
+}
+
+int http_cache_set(size_t budget, size_t compress_min)
+{
+    void *workspace = NULL;
+
+    /* Kept until unload once allocated, deflating may have picked it up */
+    if (budget && compress_min && !deflate_workspace) {
+        workspace =
+            vmalloc(zlib_deflate_workspacesize(MAX_WBITS, DEF_MEM_LEVEL));
+        if (!workspace)
+            return -ENOMEM;
+        mutex_lock(&deflate_lock);
+        WRITE_ONCE(deflate_workspace, workspace);
+        mutex_unlock(&deflate_lock);
+    }
+
+    spin_lock(&cache_lock);
+    WRITE_ONCE(compress_threshold, compress_min);
+    WRITE_ONCE(cache_budget, budget);
+    while (cache_used > budget && !list_empty(&cache_lru))
+        http_cache_unlink(
+            list_last_entry(&cache_lru, struct http_cache_entry, lru));
+    spin_unlock(&cache_lock);
+    return 0;
+}
+
+void http_cache_exit(void)
+{
+    spin_lock(&cache_lock);
+    while (!list_empty(&cache_lru))
+        http_cache_unlink(
+            list_first_entry(&cache_lru, struct http_cache_entry, lru));
+    spin_unlock(&cache_lock);
+    vfree(deflate_workspace);
+    deflate_workspace = NULL;
+}
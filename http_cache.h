@@ -0,0 +1,49 @@
+#ifndef KHTTPD_HTTP_CACHE_H
+#define KHTTPD_HTTP_CACHE_H
+
+#ifdef __KERNEL__
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/mm_types.h>
+#else
+#include "compat/user.h"
+#endif
+
+/*
+ * Cached response body. The bytes live in individually allocated pages so
+ * they can be handed to kernel_sendpage(); the network stack takes its own
+ * page references, so an entry can be evicted while a send is in flight.
+ */
+struct http_cache_entry {
+    struct hlist_node node;
+    struct list_head lru;
+    struct kref ref;
+    long long key;
+    /*
+     * Raw deflate stream of the body, compressed once at insertion, and the
+     * checksums of the body the gzip and zlib framings around it need.
+     */
+    struct http_cache_entry *deflated;
+    u32 crc32, adler32;
+    size_t size;
+    unsigned int nr_pages;
+    struct page *pages[];
+};
+
+/* Bodies of at least @compress_min bytes also get a deflated variant */
+extern int http_cache_init(size_t budget, size_t compress_min);
+extern void http_cache_exit(void);
+
+/* Change both on a live cache, evicting down to a smaller @budget */
+extern int http_cache_set(size_t budget, size_t compress_min);
+
+/* Both return a referenced entry, release it with http_cache_put() */
+extern struct http_cache_entry *http_cache_lookup(long long key);
+extern struct http_cache_entry *http_cache_insert(long long key,
+                                                  const char *body,
+                                                  size_t size);
+
+extern void http_cache_get(struct http_cache_entry *entry);
+extern void http_cache_put(struct http_cache_entry *entry);
+
+#endif
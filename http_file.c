@@ -0,0 +1,261 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/hashtable.h>
+#include <linux/jiffies.h>
+#include <linux/namei.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/stringhash.h>
+
+#include "http_file.h"
+
+#define FILE_HASH_BITS 8
+#define FILE_CACHE_MAX 256
+#define FILE_REVALIDATE HZ /* look the path up again after a second */
+
+static const struct {
+    const char *ext;
+    const char *type;
+} content_types[] = {
+    {"html", "text/html"},        {"htm", "text/html"},
+    {"css", "text/css"},          {"js", "application/javascript"},
+    {"json", "application/json"}, {"txt", "text/plain"},
+    {"png", "image/png"},         {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},       {"gif", "image/gif"},
+    {"svg", "image/svg+xml"},     {"ico", "image/x-icon"},
+};
+
+static struct path file_root; /* mnt is NULL without a document root */
+static DEFINE_HASHTABLE(file_table, FILE_HASH_BITS);
+static LIST_HEAD(file_lru); /* most recently used first */
+static DEFINE_SPINLOCK(file_lock);
+static unsigned int file_count;
+
+static void http_file_release(struct kref *ref)
+{
+    struct http_file *file = container_of(ref, struct http_file, ref);
+
+    filp_close(file->filp, NULL);
+    kfree(file);
+}
+
+void http_file_get(struct http_file *file)
+{
+    kref_get(&file->ref);
+}
+
+void http_file_put(struct http_file *file)
+{
+    kref_put(&file->ref, http_file_release);
+}
+
+bool http_file_enabled(void)
+{
+    return file_root.mnt != NULL;
+}
+
+static const char *http_file_content_type(const char *path, size_t len)
+{
+    const char *ext = path + len;
+    size_t i;
+
+    while (ext > path && ext[-1] != '.' && ext[-1] != '/')
+        ext--;
+    if (ext > path && ext[-1] == '.') {
+        for (i = 0; i < ARRAY_SIZE(content_types); i++)
+            if (strlen(content_types[i].ext) == path + len - ext &&
+                !strncasecmp(ext, content_types[i].ext, path + len - ext))
+                return content_types[i].type;
+    }
+    return "application/octet-stream";
+}
+
+/* Reject anything that could climb out of the document root */
+static bool http_file_path_valid(const char *path, size_t len)
+{
+    const char *seg = path, *end = path + len, *next;
+
+    if (!len || path[0] != '/' || memchr(path, '\0', len) ||
+        memchr(path, '\\', len))
+        return false;
+    while (seg < end) {
+        seg++; /* skip the '/' */
+        next = memchr(seg, '/', end - seg);
+        if (!next)
+            next = end;
+        if (next - seg == 2 && seg[0] == '.' && seg[1] == '.')
+            return false;
+        seg = next;
+    }
+    return true;
+}
+
+/*
+ * Called with file_lock held. The reference held by the cache moves to the
+ * caller, which drops it after unlocking since closing the file may sleep.
+ */
+static struct http_file *http_file_unlink(struct http_file *file)
+{
+    hash_del(&file->node);
+    list_del(&file->lru);
+    file_count--;
+    return file;
+}
+
+static bool http_file_fresh(struct http_file *file)
+{
+    struct inode *inode = file_inode(file->filp);
+
+    if (time_after(jiffies, file->opened + FILE_REVALIDATE))
+        return false;
+    return timespec64_equal(&inode->i_mtime, &file->mtime) &&
+           i_size_read(inode) == file->size;
+}
+
+/*
+ * Resolve @path from the document root itself rather than through a path
+ * string. A symlink as the last component is not followed, and whatever a
+ * symlink further up leads to must still be under the root.
+ */
+static struct file *http_file_resolve(const char *path, size_t len)
+{
+    struct path found;
+    struct file *filp;
+    char *name;
+    int err;
+
+    /* Relative to the root, without the leading '/' */
+    name = kstrndup(path + 1, len - 1, GFP_KERNEL);
+    if (!name)
+        return ERR_PTR(-ENOMEM);
+    err = vfs_path_lookup(file_root.dentry, file_root.mnt, name, 0, &found);
+    kfree(name);
+    if (err)
+        return ERR_PTR(-ENOENT);
+
+    /* Regular files only, opening a FIFO or device could block or worse */
+    if (!path_is_under(&found, &file_root) || !d_is_reg(found.dentry)) {
+        path_put(&found);
+        return ERR_PTR(-ENOENT);
+    }
+    filp = dentry_open(&found, O_RDONLY | O_LARGEFILE, current_cred());
+    path_put(&found);
+    return IS_ERR(filp) ? ERR_PTR(-ENOENT) : filp;
+}
+
+static struct http_file *http_file_open(const char *path, size_t len)
+{
+    struct http_file *file;
+    struct inode *inode;
+    struct file *filp;
+
+    filp = http_file_resolve(path, len);
+    if (IS_ERR(filp))
+        return ERR_CAST(filp);
+
+    inode = file_inode(filp);
+
+    file = kmalloc(struct_size(file, path, len + 1), GFP_KERNEL);
+    if (!file) {
+        filp_close(filp, NULL);
+        return ERR_PTR(-ENOMEM);
+    }
+    kref_init(&file->ref);
+    file->filp = filp;
+    file->size = i_size_read(inode);
+    file->mtime = inode->i_mtime;
+    file->opened = jiffies;
+    file->content_type = http_file_content_type(path, len);
+    file->path_len = len;
+    memcpy(file->path, path, len);
+    file->path[len] = '\0';
+    return file;
+}
+
+struct http_file *http_file_lookup(const char *path, size_t len)
+{
+    u32 hash = full_name_hash(NULL, path, len);
+    struct http_file *file, *old = NULL, *stale = NULL, *victim = NULL;
+
+    if (!file_root.mnt || !http_file_path_valid(path, len))
+        return ERR_PTR(-ENOENT);
+
+    spin_lock(&file_lock);
+    hash_for_each_possible (file_table, file, node, hash) {
+        if (file->path_len == len && !memcmp(file->path, path, len)) {
+            old = file;
+            break;
+        }
+    }
+    if (old && http_file_fresh(old)) {
+        list_move(&old->lru, &file_lru);
+        http_file_get(old);
+        spin_unlock(&file_lock);
+        return old;
+    }
+    spin_unlock(&file_lock);
+
+    /* Miss or stale entry: the only place a path lookup happens */
+    file = http_file_open(path, len);
+    if (IS_ERR(file))
+        return file;
+
+    spin_lock(&file_lock);
+    hash_for_each_possible (file_table, old, node, hash) {
+        if (old->path_len == len && !memcmp(old->path, path, len)) {
+            stale = http_file_unlink(old);
+            break;
+        }
+    }
+    if (file_count == FILE_CACHE_MAX)
+        victim = http_file_unlink(
+            list_last_entry(&file_lru, struct http_file, lru));
+    hash_add(file_table, &file->node, hash);
+    list_add(&file->lru, &file_lru);
+    file_count++;
+    http_file_get(file);
+    spin_unlock(&file_lock);
+
+    if (stale)
+        http_file_put(stale);
+    if (victim)
+        http_file_put(victim);
+    return file;
+}
+
+int http_file_init(const char *docroot)
+{
+    struct path root;
+    int err;
+
+    if (!*docroot)
+        return 0;
+    err = kern_path(docroot, LOOKUP_FOLLOW | LOOKUP_DIRECTORY, &root);
+    if (err) {
+        pr_err("can't open document root %s: %d\n", docroot, err);
+        return err;
+    }
+    file_root = root;
+    return 0;
+}
+
+void http_file_exit(void)
+{
+    struct http_file *file, *tmp;
+    LIST_HEAD(list);
+
+    spin_lock(&file_lock);
+    list_splice_init(&file_lru, &list);
+    hash_init(file_table);
+    file_count = 0;
+    spin_unlock(&file_lock);
+
+    list_for_each_entry_safe (file, tmp, &list, lru)
+        http_file_put(file);
+    if (file_root.mnt)
+        path_put(&file_root);
+    file_root.mnt = NULL;
+    file_root.dentry = NULL;
+}
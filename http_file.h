@@ -0,0 +1,39 @@
+#ifndef KHTTPD_HTTP_FILE_H
+#define KHTTPD_HTTP_FILE_H
+
+#ifdef __KERNEL__
+#include <linux/fs.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#else
+#include "compat/user.h"
+#endif
+
+/* Open file under the document root, cached by request path */
+struct http_file {
+    struct hlist_node node;
+    struct list_head lru;
+    struct kref ref;
+    struct file *filp;
+    loff_t size;
+    struct timespec64 mtime;
+    unsigned long opened; /* jiffies, the path is looked up again later */
+    const char *content_type;
+    size_t path_len;
+    char path[];
+};
+
+extern int http_file_init(const char *docroot);
+extern void http_file_exit(void);
+extern bool http_file_enabled(void);
+
+/*
+ * Return the referenced file for a request path relative to the document
+ * root, or an ERR_PTR: -ENOENT for paths that can't be served.
+ */
+extern struct http_file *http_file_lookup(const char *path, size_t len);
+
+extern void http_file_get(struct http_file *file);
+extern void http_file_put(struct http_file *file);
+
+#endif
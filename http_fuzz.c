@@ -0,0 +1,97 @@
+/*
+ * libFuzzer harness for the request path, parser included, over a socket
+ * pair: make http_fuzz && ./http_fuzz
+ *
+ * The first byte of an input is the size of the pieces the rest is sent
+ * in, so requests split over several receives are reassembled as well.
+ */
+
+#include "http_server.h"
+
+/*
+ * Keep /fib fast enough to fuzz: the numbers of an input may together cost
+ * what F(10000) does, squares of N / 32 as for rate limiting. Numbers past
+ * LLONG_MAX cost nothing, they are refused before anything is computed.
+ */
+#define FUZZ_COST ((10000ULL / 32) * (10000ULL / 32))
+
+static bool fuzz_too_costly(const uint8_t *data, size_t size)
+{
+    unsigned long long n = 0, cost = 0;
+    bool overflow = false;
+    size_t i;
+
+    for (i = 0; i <= size; i++) {
+        if (i < size && isdigit(data[i])) {
+            overflow |= n > (LLONG_MAX - (data[i] - '0')) / 10ULL;
+            n = overflow ? 0 : n * 10 + (data[i] - '0');
+            continue;
+        }
+        cost += (n / 32) * (n / 32);
+        if (cost > FUZZ_COST)
+            return true;
+        n = 0;
+        overflow = false;
+    }
+    return false;
+}
+
+/* Throw away whatever the server sent */
+static void fuzz_drain(int fd)
+{
+    char sink[4096];
+
+    while (read(fd, sink, sizeof(sink)) > 0)
+        ;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static struct http_server_param param = {
+        .batch_max = 100,
+        .batch_cost = 10000,
+    };
+    static char *buf;
+    struct http_conn *conn;
+    size_t piece, off;
+    ssize_t len;
+    int sv[2], ret = 0;
+
+    if (!buf) {
+        if (http_user_start(&param) || http_server_register_builtins())
+            abort();
+        buf = http_user_buf_alloc();
+        if (!buf)
+            abort();
+    }
+    if (!size || fuzz_too_costly(data, size))
+        return 0;
+    piece = data[0] ? data[0] : size;
+    data++;
+    size--;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv))
+        abort();
+    conn = http_user_conn_open(sv[0]);
+    if (!conn)
+        abort();
+    for (off = 0; off < size && ret >= 0; off += len) {
+        len = write(sv[1], data + off, min(piece, size - off));
+        if (len <= 0)
+            break;
+        while ((ret = http_user_conn_process(conn, buf)) > 0)
+            fuzz_drain(sv[1]);
+        fuzz_drain(sv[1]);
+    }
+    /* The client is done, let the server see the end of the stream */
+    shutdown(sv[1], SHUT_WR);
+    while (ret >= 0) {
+        ret = http_user_conn_process(conn, buf);
+        fuzz_drain(sv[1]);
+        if (!ret)
+            break;
+    }
+    http_user_conn_close(conn);
+    close(sv[1]);
+    return 0;
+}
@@ -0,0 +1,304 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/cpumask.h>
+#include <linux/hash.h>
+#include <linux/in.h>
+#include <linux/jhash.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+#include "http_limit.h"
+
+#define LIMIT_HASH_BITS 8    /* heads per shard */
+#define LIMIT_SHARD_MAX 1024 /* clients tracked per shard */
+#define LIMIT_SWEEP (10 * HZ)
+
+enum {
+    HTTP_CLIENT_THROTTLED, /* counted in http_limit_stats.clients */
+};
+
+/*
+ * Generic cell rate algorithm: rather than a token count the bucket keeps
+ * the time it is full again. Taking tokens pushes that time further out,
+ * which is refused when it would end up more than a burst ahead of now.
+ */
+struct http_client {
+    struct hlist_node node;
+    __be32 addr;
+    atomic_t refs;  /* connections, the table holds none */
+    atomic64_t tat; /* ktime_get_ns() the bucket is full at */
+    unsigned long flags;
+};
+
+/*
+ * The table is split by address hash into a shard per CPU, each under a
+ * lock of its own. Clients are not bound to a CPU, a bucket per CPU would
+ * hand a client whose connections spread over them several times the rate.
+ */
+struct http_limit_shard {
+    spinlock_t lock;
+    unsigned int nr;
+    struct hlist_head heads[1 << LIMIT_HASH_BITS];
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Replaced as a whole when the rate or burst change, so a charge never
+ * mixes the two settings. The table outlives it, buckets keep their state.
+ */
+struct http_limit_config {
+    struct http_limit_shard *shards;
+    unsigned int nr_shards; /* power of two */
+    u32 seed;
+    u64 interval;      /* ns a token takes to come back */
+    u64 burst, window; /* tokens and ns of a full bucket */
+};
+
+struct http_limit_stats http_limit_stats;
+
+static struct http_limit_config __rcu *limit_config; /* NULL: not limited */
+static DEFINE_MUTEX(limit_lock);
+/* Allocated when first limited, then kept until unload */
+static struct http_limit_shard *shards;
+static unsigned int nr_shards;
+static u32 limit_seed;
+static struct delayed_work limit_sweep;
+
+/* Called with the shard lock held: a full bucket is as good as none */
+static void http_limit_prune(struct http_limit_shard *shard, u64 now)
+{
+    struct http_client *client;
+    struct hlist_node *tmp;
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(shard->heads); i++) {
+        hlist_for_each_entry_safe (client, tmp, &shard->heads[i], node) {
+            if (atomic_read(&client->refs) ||
+                (u64) atomic64_read(&client->tat) > now)
+                continue;
+            hlist_del(&client->node);
+            shard->nr--;
+            kfree(client);
+        }
+    }
+}
+
+static void http_limit_sweep(struct work_struct *work)
+{
+    u64 now = ktime_get_ns();
+    unsigned int i;
+
+    for (i = 0; i < nr_shards; i++) {
+        spin_lock(&shards[i].lock);
+        http_limit_prune(&shards[i], now);
+        spin_unlock(&shards[i].lock);
+    }
+    queue_delayed_work(system_wq, &limit_sweep, LIMIT_SWEEP);
+}
+
+/* Bucket of the peer of @socket, NULL when not limited */
+static struct http_client *http_limit_get(struct socket *socket)
+{
+    const struct http_limit_config *config;
+    struct http_limit_shard *shard = NULL;
+    struct http_client *client;
+    struct hlist_head *head;
+    struct sockaddr_in peer;
+    u32 hash;
+
+    if (!rcu_access_pointer(limit_config) ||
+        kernel_getpeername(socket, (struct sockaddr *) &peer) < 0 ||
+        peer.sin_family != AF_INET)
+        return NULL;
+    rcu_read_lock();
+    config = rcu_dereference(limit_config);
+    if (config) {
+        hash = jhash_1word((__force u32) peer.sin_addr.s_addr, config->seed);
+        shard = &config->shards[hash & (config->nr_shards - 1)];
+    }
+    rcu_read_unlock();
+    if (!shard)
+        return NULL;
+    head = &shard->heads[hash_32(hash, LIMIT_HASH_BITS)];
+
+    spin_lock(&shard->lock);
+    hlist_for_each_entry (client, head, node)
+        if (client->addr == peer.sin_addr.s_addr)
+            goto found;
+    if (shard->nr >= LIMIT_SHARD_MAX)
+        http_limit_prune(shard, ktime_get_ns());
+    /* Too many clients at once to keep track of, let them through */
+    client = shard->nr < LIMIT_SHARD_MAX
+                 ? kmalloc(sizeof(*client), GFP_ATOMIC)
+                 : NULL;
+    if (!client) {
+        spin_unlock(&shard->lock);
+        return NULL;
+    }
+    client->addr = peer.sin_addr.s_addr;
+    atomic_set(&client->refs, 0);
+    atomic64_set(&client->tat, 0);
+    client->flags = 0;
+    hlist_add_head(&client->node, head);
+    shard->nr++;
+found:
+    atomic_inc(&client->refs);
+    spin_unlock(&shard->lock);
+    return client;
+}
+
+void http_limit_put(struct http_client *client)
+{
+    if (!client)
+        return;
+    /* Pruned as soon as the count drops, so no access may follow it */
+    smp_mb__before_atomic();
+    atomic_dec(&client->refs);
+}
+
+bool http_limit_charge(struct http_client *client, u64 cost)
+{
+    const struct http_limit_config *config;
+    u64 now, tat, old, next;
+    bool allowed = false;
+
+    if (!client)
+        return true;
+    rcu_read_lock();
+    config = rcu_dereference(limit_config);
+    /* Lifted since the client was looked up */
+    if (!config) {
+        allowed = true;
+    } else {
+        /*
+         * A full bucket, less the token the request itself took, pays for
+         * anything however costly: no request is out of reach for good.
+         * This also keeps the product below in range.
+         */
+        cost = min_t(u64, cost, config->burst - 1);
+        now = ktime_get_ns();
+        old = atomic64_read(&client->tat);
+        for (;;) {
+            tat = max(old, now);
+            next = tat + cost * config->interval;
+            if (next - now > config->window)
+                break;
+            tat = atomic64_cmpxchg(&client->tat, old, next);
+            if (tat == old) {
+                allowed = true;
+                break;
+            }
+            old = tat;
+        }
+    }
+    rcu_read_unlock();
+
+    if (allowed) {
+        if (test_bit(HTTP_CLIENT_THROTTLED, &client->flags))
+            clear_bit(HTTP_CLIENT_THROTTLED, &client->flags);
+        return true;
+    }
+    if (!test_and_set_bit(HTTP_CLIENT_THROTTLED, &client->flags))
+        atomic_long_inc(&http_limit_stats.clients);
+    return false;
+}
+
+bool http_limit_accept(struct socket *socket, struct http_client **client)
+{
+    *client = http_limit_get(socket);
+    if (http_limit_charge(*client, 1))
+        return true;
+    http_limit_put(*client);
+    *client = NULL;
+    return false;
+}
+
+/* Called with limit_lock held */
+static int http_limit_alloc(void)
+{
+    unsigned int i, j;
+
+    if (shards)
+        return 0;
+    nr_shards = roundup_pow_of_two(num_possible_cpus());
+    shards = kvcalloc(nr_shards, sizeof(*shards), GFP_KERNEL);
+    if (!shards)
+        return -ENOMEM;
+    for (i = 0; i < nr_shards; i++) {
+        spin_lock_init(&shards[i].lock);
+        for (j = 0; j < ARRAY_SIZE(shards[i].heads); j++)
+            INIT_HLIST_HEAD(&shards[i].heads[j]);
+    }
+    /* Keep clients from picking addresses that share a chain */
+    limit_seed = get_random_u32();
+
+    INIT_DELAYED_WORK(&limit_sweep, http_limit_sweep);
+    queue_delayed_work(system_wq, &limit_sweep, LIMIT_SWEEP);
+    return 0;
+}
+
+int http_limit_set(unsigned int rate, unsigned int burst)
+{
+    struct http_limit_config *config = NULL, *old;
+    int err = 0;
+
+    mutex_lock(&limit_lock);
+    if (rate) {
+        err = http_limit_alloc();
+        if (err)
+            goto out;
+        config = kmalloc(sizeof(*config), GFP_KERNEL);
+        if (!config) {
+            err = -ENOMEM;
+            goto out;
+        }
+        config->shards = shards;
+        config->nr_shards = nr_shards;
+        config->seed = limit_seed;
+        config->interval = max_t(u64, NSEC_PER_SEC / rate, 1);
+        config->burst = max(burst, 1U);
+        config->window = config->burst * config->interval;
+    }
+
+    old = rcu_dereference_protected(limit_config,
+                                    lockdep_is_held(&limit_lock));
+    rcu_assign_pointer(limit_config, config);
+    synchronize_rcu();
+    kfree(old);
+out:
+    mutex_unlock(&limit_lock);
+    return err;
+}
+
+int http_limit_init(unsigned int rate, unsigned int burst)
+{
+    atomic_long_set(&http_limit_stats.clients, 0);
+    return http_limit_set(rate, burst);
+}
+
+/* Nothing is looked up or charged any more */
+void http_limit_exit(void)
+{
+    struct http_client *client;
+    struct hlist_node *tmp;
+    unsigned int i, j;
+
+    kfree(rcu_dereference_protected(limit_config, 1));
+    RCU_INIT_POINTER(limit_config, NULL);
+    if (!shards)
+        return;
+    cancel_delayed_work_sync(&limit_sweep);
+    for (i = 0; i < nr_shards; i++)
+        for (j = 0; j < ARRAY_SIZE(shards[i].heads); j++)
+            hlist_for_each_entry_safe (client, tmp, &shards[i].heads[j],
+                                       node)
+                kfree(client);
+    kvfree(shards);
+    shards = NULL;
+}
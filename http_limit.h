@@ -0,0 +1,48 @@
+#ifndef KHTTPD_HTTP_LIMIT_H
+#define KHTTPD_HTTP_LIMIT_H
+
+#ifdef __KERNEL__
+#include <linux/atomic.h>
+#include <linux/net.h>
+#include <linux/types.h>
+#else
+#include "compat/user.h"
+#endif
+
+/*
+ * Token bucket of a client address, refilled at the configured rate up to
+ * the burst size. Connections take a reference for their lifetime, so the
+ * request path charges it without a lookup; buckets nobody references are
+ * dropped once full again, when they no longer hold any state.
+ */
+struct http_client;
+
+struct http_limit_stats {
+    atomic_long_t clients; /* buckets that ran dry, once per episode */
+};
+
+extern struct http_limit_stats http_limit_stats;
+
+/* @rate tokens a second, at most @burst at once; a zero @rate disables it */
+extern int http_limit_init(unsigned int rate, unsigned int burst);
+extern void http_limit_exit(void);
+
+/* Change the rate and burst of a live limiter; buckets keep their state */
+extern int http_limit_set(unsigned int rate, unsigned int burst);
+
+/*
+ * Take a token for a new connection, false if its client is over limit.
+ * Otherwise @client is the bucket of the peer of @socket for the connection
+ * to charge, NULL when not limited, referenced until http_limit_put().
+ */
+extern bool http_limit_accept(struct socket *socket,
+                              struct http_client **client);
+extern void http_limit_put(struct http_client *client);
+
+/*
+ * Take @cost tokens, false if the client can't afford them. A cost past a
+ * full bucket less one token is charged as that much instead.
+ */
+extern bool http_limit_charge(struct http_client *client, u64 cost);
+
+#endif
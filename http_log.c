@@ -0,0 +1,162 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+
+#include "http_log.h"
+#include "http_stats.h"
+
+#define LOG_SIZE_MAX (1U << 20)
+
+/*
+ * Single-producer, single-consumer ring per CPU. Records are only written
+ * from process context with preemption off, so the CPU owning the ring is
+ * its only producer; readers take log_lock among themselves. Neither side
+ * ever waits for the other: a full ring drops the record and counts it.
+ */
+struct http_log_ring {
+    unsigned long head; /* next record written, producer only */
+    u32 dropped;        /* since the last record written */
+    struct http_log_record *records;
+    unsigned long tail ____cacheline_aligned_in_smp; /* consumer only */
+};
+
+static struct http_log_ring __percpu *rings;
+static unsigned long log_size; /* records per ring, power of two */
+static DEFINE_MUTEX(log_lock);
+static struct dentry *log_file;
+
+bool http_log_enabled(void)
+{
+    return rings != NULL;
+}
+
+void http_log_write(struct http_log_record *record)
+{
+    struct http_log_ring *ring;
+    unsigned long head;
+
+    if (!rings)
+        return;
+    ring = get_cpu_ptr(rings);
+    head = ring->head;
+    if (head - smp_load_acquire(&ring->tail) >= log_size) {
+        ring->dropped++;
+        put_cpu_ptr(rings);
+        http_stats_count(HTTP_STAT_LOG_DROPPED);
+        return;
+    }
+    record->cpu = smp_processor_id();
+    record->dropped = ring->dropped;
+    ring->dropped = 0;
+    ring->records[head & (log_size - 1)] = *record;
+    /* The record is complete before the reader can see it */
+    smp_store_release(&ring->head, head + 1);
+    put_cpu_ptr(rings);
+}
+
+/* Copy whole records of @ring to @buf, up to @count bytes; returns bytes */
+static ssize_t http_log_drain(struct http_log_ring *ring,
+                              char __user *buf,
+                              size_t count)
+{
+    const size_t size = sizeof(struct http_log_record);
+    unsigned long tail = ring->tail, head = smp_load_acquire(&ring->head);
+    size_t nr = min_t(size_t, head - tail, count / size);
+    size_t off = tail & (log_size - 1), first = min(nr, log_size - off);
+
+    if (!nr)
+        return 0;
+    /* Up to the end of the ring, then on from its start */
+    if (copy_to_user(buf, ring->records + off, first * size) ||
+        copy_to_user(buf + first * size, ring->records, (nr - first) * size))
+        return -EFAULT;
+    /* Done with the slots, the producer may reuse them */
+    smp_store_release(&ring->tail, tail + nr);
+    return nr * size;
+}
+
+/*
+ * Whatever every ring holds, as binary records ordered per CPU only. Reads
+ * at the end of the log return 0, so a reader polls for more.
+ */
+static ssize_t http_log_read(struct file *file,
+                             char __user *buf,
+                             size_t count,
+                             loff_t *ppos)
+{
+    ssize_t ret, done = 0;
+    int cpu;
+
+    if (count < sizeof(struct http_log_record))
+        return -EINVAL;
+    if (mutex_lock_interruptible(&log_lock))
+        return -EINTR;
+    for_each_possible_cpu (cpu) {
+        ret = http_log_drain(per_cpu_ptr(rings, cpu), buf + done,
+                             count - done);
+        if (ret < 0) {
+            if (!done)
+                done = ret;
+            break;
+        }
+        done += ret;
+    }
+    mutex_unlock(&log_lock);
+    return done;
+}
+
+static const struct file_operations http_log_fops = {
+    .owner = THIS_MODULE,
+    .open = nonseekable_open,
+    .read = http_log_read,
+    .llseek = no_llseek,
+};
+
+int http_log_init(unsigned int size)
+{
+    struct dentry *dir;
+    int cpu;
+
+    if (!size)
+        return 0;
+    log_size = roundup_pow_of_two(min(size, LOG_SIZE_MAX));
+    rings = alloc_percpu(struct http_log_ring);
+    if (!rings)
+        return -ENOMEM;
+    for_each_possible_cpu (cpu) {
+        struct http_log_ring *ring = per_cpu_ptr(rings, cpu);
+
+        ring->records = vmalloc_node(log_size * sizeof(*ring->records),
+                                     cpu_to_node(cpu));
+        if (!ring->records) {
+            http_log_exit();
+            return -ENOMEM;
+        }
+    }
+    /* Next to the stats, in the directory http_stats_init() made */
+    dir = debugfs_lookup(KBUILD_MODNAME, NULL);
+    log_file = debugfs_create_file("access_log", 0400, dir, NULL,
+                                   &http_log_fops);
+    dput(dir);
+    return 0;
+}
+
+void http_log_exit(void)
+{
+    int cpu;
+
+    if (!rings)
+        return;
+    debugfs_remove(log_file);
+    log_file = NULL;
+    for_each_possible_cpu (cpu)
+        vfree(per_cpu_ptr(rings, cpu)->records);
+    free_percpu(rings);
+    rings = NULL;
+}
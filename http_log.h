@@ -0,0 +1,35 @@
+#ifndef KHTTPD_HTTP_LOG_H
+#define KHTTPD_HTTP_LOG_H
+
+/* The record layout is shared with the reader, see khttpd-log.c */
+#include <linux/types.h>
+#ifndef __KERNEL__
+#include <stdbool.h>
+#endif
+
+/*
+ * Access log record, one per response, as read from
+ * /sys/kernel/debug/khttpd/access_log. Times are CLOCK_MONOTONIC.
+ */
+struct http_log_record {
+    __u64 time;    /* ns, request start, accept for the first one */
+    __u64 latency; /* ns from there to the last byte of the response sent */
+    __u64 bytes;   /* of the response actually sent */
+    __s64 n;       /* /fib number, -1 for anything else */
+    __be32 addr;   /* client IPv4 address */
+    __u16 status;  /* 0: no response pending */
+    __u8 route;    /* enum http_route */
+    __u8 reserved;
+    __u32 cpu;     /* ring the record went through */
+    __u32 dropped; /* records lost on that ring just before this one */
+};
+
+/* @size records per CPU, rounded up to a power of two; 0 disables it */
+extern int http_log_init(unsigned int size);
+extern void http_log_exit(void);
+extern bool http_log_enabled(void);
+
+/* A few stores into the ring of this CPU, dropped if the reader lags */
+extern void http_log_write(struct http_log_record *record);
+
+#endif
@@ -0,0 +1,551 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/err.h>
+#include <linux/inet.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/tcp.h>
+#include <net/sock.h>
+#include <net/tcp_states.h>
+
+#include "http_parser.h"
+#include "http_proxy.h"
+
+#define UPSTREAM_MAX 16
+#define UPSTREAM_TIMEOUT (30 * HZ)
+#define PROXY_HEAD_MAX 4096 /* response header lines passed on */
+
+struct http_upstream {
+    struct sockaddr_in addr;
+    char host[sizeof("255.255.255.255:65535")]; /* Host header value */
+    spinlock_t lock;         /* protects idle and nr_idle */
+    struct list_head idle;   /* keep-alive connections, most recent first */
+    unsigned int nr_idle;
+    atomic_t active;         /* requests in flight, for least-connections */
+};
+
+/* Connection to an upstream, owned by one request at a time */
+struct http_proxy_conn {
+    struct list_head list;
+    struct socket *socket;
+    struct http_upstream *upstream;
+    bool reused; /* came from the idle list, the peer may have closed it */
+};
+
+static struct http_upstream upstreams[UPSTREAM_MAX];
+static unsigned int nr_upstreams, proxy_pool_size;
+static bool proxy_least_conn;
+static atomic_t next_upstream;
+
+bool http_proxy_enabled(void)
+{
+    return nr_upstreams != 0;
+}
+
+static int http_proxy_send(struct socket *sock,
+                           const char *buf,
+                           size_t size,
+                           int flags)
+{
+    struct msghdr msg = {.msg_flags = flags | MSG_NOSIGNAL};
+    struct kvec iov;
+
+    while (size) {
+        int length;
+
+        iov.iov_base = (void *) buf;
+        iov.iov_len = size;
+        length = kernel_sendmsg(sock, &msg, &iov, 1, size);
+        if (length <= 0)
+            return length ? length : -EPIPE;
+        buf += length;
+        size -= length;
+    }
+    return 0;
+}
+
+static int http_proxy_recv(struct socket *sock, char *buf, size_t size)
+{
+    struct kvec iov = {.iov_base = buf, .iov_len = size};
+    struct msghdr msg = {.msg_flags = 0};
+
+    return kernel_recvmsg(sock, &msg, &iov, 1, size, 0);
+}
+
+static void http_proxy_release(struct http_proxy_conn *pc)
+{
+    kernel_sock_shutdown(pc->socket, SHUT_RDWR);
+    sock_release(pc->socket);
+    kfree(pc);
+}
+
+static struct http_proxy_conn *http_proxy_connect(struct http_upstream *up)
+{
+    struct http_proxy_conn *pc;
+    int err, one = 1;
+
+    pc = kmalloc(sizeof(*pc), GFP_KERNEL);
+    if (!pc)
+        return ERR_PTR(-ENOMEM);
+    err = sock_create_kern(&init_net, PF_INET, SOCK_STREAM, IPPROTO_TCP,
+                           &pc->socket);
+    if (err < 0)
+        goto bail_free;
+    /* A stuck backend must not hold the worker forever */
+    pc->socket->sk->sk_rcvtimeo = UPSTREAM_TIMEOUT;
+    pc->socket->sk->sk_sndtimeo = UPSTREAM_TIMEOUT;
+    kernel_setsockopt(pc->socket, SOL_TCP, TCP_NODELAY, (char *) &one,
+                      sizeof(one));
+    err = kernel_connect(pc->socket, (struct sockaddr *) &up->addr,
+                         sizeof(up->addr), 0);
+    if (err < 0) {
+        pr_err("can't connect to upstream %s: %d\n", up->host, err);
+        goto bail_sock;
+    }
+    pc->upstream = up;
+    pc->reused = false;
+    return pc;
+
+bail_sock:
+    sock_release(pc->socket);
+bail_free:
+    kfree(pc);
+    return ERR_PTR(err);
+}
+
+/* Round-robin, or the least busy upstream with ties taken round-robin */
+static struct http_upstream *http_proxy_pick(void)
+{
+    unsigned int i, start = atomic_inc_return(&next_upstream);
+    struct http_upstream *best = &upstreams[start % nr_upstreams];
+
+    if (!proxy_least_conn)
+        return best;
+    for (i = 1; i < nr_upstreams; i++) {
+        struct http_upstream *up = &upstreams[(start + i) % nr_upstreams];
+        if (atomic_read(&up->active) < atomic_read(&best->active))
+            best = up;
+    }
+    return best;
+}
+
+/* Usable unless the peer closed it or sent something unsolicited */
+static bool http_proxy_alive(struct http_proxy_conn *pc)
+{
+    struct sock *sk = pc->socket->sk;
+
+    return sk->sk_state == TCP_ESTABLISHED &&
+           skb_queue_empty(&sk->sk_receive_queue);
+}
+
+static struct http_proxy_conn *http_proxy_get(struct http_upstream *up,
+                                              bool fresh)
+{
+    struct http_proxy_conn *pc;
+
+    spin_lock(&up->lock);
+    while (!fresh && !list_empty(&up->idle)) {
+        pc = list_first_entry(&up->idle, struct http_proxy_conn, list);
+        list_del(&pc->list);
+        up->nr_idle--;
+        spin_unlock(&up->lock);
+        if (http_proxy_alive(pc)) {
+            pc->reused = true;
+            atomic_inc(&up->active);
+            return pc;
+        }
+        http_proxy_release(pc);
+        spin_lock(&up->lock);
+    }
+    spin_unlock(&up->lock);
+
+    /* Only a miss in the pool costs a handshake */
+    pc = http_proxy_connect(up);
+    if (!IS_ERR(pc))
+        atomic_inc(&up->active);
+    return pc;
+}
+
+static void http_proxy_put(struct http_proxy_conn *pc, bool reusable)
+{
+    struct http_upstream *up = pc->upstream;
+
+    atomic_dec(&up->active);
+    if (reusable) {
+        spin_lock(&up->lock);
+        if (up->nr_idle < proxy_pool_size) {
+            list_add(&pc->list, &up->idle);
+            up->nr_idle++;
+            spin_unlock(&up->lock);
+            return;
+        }
+        spin_unlock(&up->lock);
+    }
+    http_proxy_release(pc);
+}
+
+/*
+ * Upstream response on its way to the client. Its head is rebuilt without
+ * the hop-by-hop headers, and its body framed for the client connection
+ * rather than for the upstream one.
+ */
+struct http_proxy_relay {
+    struct socket *client;
+    bool http11;     /* the client takes chunked bodies */
+    bool keep_alive; /* in: the client asked for it, out: it stays open */
+    bool chunked;    /* the body is chunked again for the client */
+    bool sent;
+    bool complete;
+    int err;
+    char reason[64]; /* truncated, it's only for show */
+    size_t reason_len;
+    char name[24]; /* of the header being parsed, enough to compare */
+    size_t name_len;
+    size_t line;   /* where that header starts in head */
+    bool in_value, skip;
+    char *head; /* header lines kept, PROXY_HEAD_MAX bytes */
+    size_t head_len;
+};
+
+/* Meaningful for one connection only, never passed on */
+static const char *const hop_by_hop[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE",
+    "Trailer",    "Transfer-Encoding", "Upgrade",
+};
+
+static int http_proxy_append(struct http_proxy_relay *relay,
+                             const char *at,
+                             size_t len)
+{
+    if (len > PROXY_HEAD_MAX - relay->head_len) {
+        relay->err = -E2BIG;
+        return -1;
+    }
+    memcpy(relay->head + relay->head_len, at, len);
+    relay->head_len += len;
+    return 0;
+}
+
+static int http_proxy_status(http_parser *parser, const char *at, size_t len)
+{
+    struct http_proxy_relay *relay = parser->data;
+
+    len = min(len, sizeof(relay->reason) - relay->reason_len);
+    memcpy(relay->reason + relay->reason_len, at, len);
+    relay->reason_len += len;
+    return 0;
+}
+
+static int http_proxy_append_str(struct http_proxy_relay *relay,
+                                 const char *str)
+{
+    return http_proxy_append(relay, str, strlen(str));
+}
+
+/* The header before the next one, or before the end of the head, is done */
+static int http_proxy_header_end(struct http_proxy_relay *relay)
+{
+    if (!relay->in_value || relay->skip)
+        return 0;
+    return http_proxy_append_str(relay, "\r\n");
+}
+
+/* Names and values may arrive in pieces, split across receives */
+static int http_proxy_header_field(http_parser *parser,
+                                   const char *at,
+                                   size_t len)
+{
+    struct http_proxy_relay *relay = parser->data;
+    size_t n;
+
+    if (relay->in_value || !relay->name_len) {
+        if (http_proxy_header_end(relay))
+            return -1;
+        relay->in_value = false;
+        relay->line = relay->head_len;
+    }
+    n = min(len, sizeof(relay->name) - relay->name_len);
+    memcpy(relay->name + relay->name_len, at, n);
+    relay->name_len += n;
+    return http_proxy_append(relay, at, len);
+}
+
+static int http_proxy_header_value(http_parser *parser,
+                                   const char *at,
+                                   size_t len)
+{
+    struct http_proxy_relay *relay = parser->data;
+    size_t i;
+
+    if (!relay->in_value) {
+        relay->in_value = true;
+        relay->skip = false;
+        for (i = 0; i < ARRAY_SIZE(hop_by_hop); i++)
+            if (strlen(hop_by_hop[i]) == relay->name_len &&
+                !strncasecmp(relay->name, hop_by_hop[i], relay->name_len))
+                relay->skip = true;
+        relay->name_len = 0;
+        if (relay->skip)
+            relay->head_len = relay->line;
+        else if (http_proxy_append_str(relay, ": "))
+            return -1;
+    }
+    return relay->skip ? 0 : http_proxy_append(relay, at, len);
+}
+
+/* Frame the body for the client and send the head */
+static int http_proxy_headers_complete(http_parser *parser)
+{
+    struct http_proxy_relay *relay = parser->data;
+    unsigned int status = parser->status_code;
+    char line[sizeof(relay->reason) + 32];
+    bool bodyless, sized;
+    size_t len;
+    int err;
+
+    if (http_proxy_header_end(relay))
+        return -1;
+    bodyless = status / 100 == 1 || status == 204 || status == 304;
+    /* Its Content-Length then went along with the other headers */
+    sized = !(parser->flags & F_CHUNKED) &&
+            parser->content_length != ULLONG_MAX;
+    if (!bodyless && !sized) {
+        if (relay->http11) {
+            relay->chunked = true;
+            if (http_proxy_append_str(relay, "Transfer-Encoding: chunked\r\n"))
+                return -1;
+        } else {
+            /* An HTTP/1.0 client only sees the end of it by the close */
+            relay->keep_alive = false;
+        }
+    }
+    if (http_proxy_append_str(relay, relay->keep_alive
+                                         ? "Connection: keep-alive\r\n\r\n"
+                                         : "Connection: close\r\n\r\n"))
+        return -1;
+
+    len = scnprintf(line, sizeof(line), "HTTP/1.1 %u %.*s\r\n", status,
+                    (int) relay->reason_len, relay->reason);
+    err = http_proxy_send(relay->client, line, len, MSG_MORE);
+    if (!err)
+        err = http_proxy_send(relay->client, relay->head, relay->head_len,
+                              0);
+    relay->sent = true;
+    relay->err = err;
+    return err ? -1 : 0;
+}
+
+static int http_proxy_body(http_parser *parser, const char *at, size_t len)
+{
+    struct http_proxy_relay *relay = parser->data;
+    char size[16];
+    int err;
+
+    if (!relay->chunked) {
+        relay->err = http_proxy_send(relay->client, at, len, 0);
+        return relay->err ? -1 : 0;
+    }
+    err = http_proxy_send(relay->client, size,
+                          scnprintf(size, sizeof(size), "%zx\r\n", len),
+                          MSG_MORE);
+    if (!err)
+        err = http_proxy_send(relay->client, at, len, MSG_MORE);
+    if (!err)
+        err = http_proxy_send(relay->client, "\r\n", 2, 0);
+    relay->err = err;
+    return err ? -1 : 0;
+}
+
+static int http_proxy_message_complete(http_parser *parser)
+{
+    struct http_proxy_relay *relay = parser->data;
+
+    relay->complete = true;
+    if (relay->chunked)
+        relay->err = http_proxy_send(relay->client, "0\r\n\r\n", 5, 0);
+    /* Anything after the response is not ours to forward */
+    http_parser_pause(parser, 1);
+    return 0;
+}
+
+static const struct http_parser_settings proxy_settings = {
+    .on_status = http_proxy_status,
+    .on_header_field = http_proxy_header_field,
+    .on_header_value = http_proxy_header_value,
+    .on_headers_complete = http_proxy_headers_complete,
+    .on_body = http_proxy_body,
+    .on_message_complete = http_proxy_message_complete,
+};
+
+int http_proxy_forward(struct socket *client,
+                       const char *url,
+                       size_t url_len,
+                       const char *headers,
+                       char *buf,
+                       size_t size,
+                       bool http11,
+                       bool *keep_alive,
+                       bool *sent)
+{
+    struct http_upstream *up = http_proxy_pick();
+    struct http_proxy_relay relay;
+    struct http_proxy_conn *pc;
+    struct http_parser parser;
+    bool received, reusable, fresh = false;
+    bool client_keep_alive = *keep_alive;
+    size_t len;
+    int ret;
+
+    relay.head = kmalloc(PROXY_HEAD_MAX, GFP_KERNEL);
+    if (!relay.head)
+        return -ENOMEM;
+retry:
+    *sent = false;
+    *keep_alive = false;
+    received = reusable = false;
+    relay = (struct http_proxy_relay){
+        .client = client,
+        .http11 = http11,
+        .keep_alive = client_keep_alive,
+        .head = relay.head,
+    };
+    /* @buf is rebuilt on a retry, it also holds the response */
+    len = snprintf(buf, size,
+                   "GET %.*s HTTP/1.1\r\nHost: %s\r\n"
+                   "Connection: keep-alive\r\n%s\r\n",
+                   (int) url_len, url, up->host, headers);
+    if (len >= size) {
+        ret = -E2BIG;
+        goto out;
+    }
+    pc = http_proxy_get(up, fresh);
+    if (IS_ERR(pc)) {
+        ret = PTR_ERR(pc);
+        goto out;
+    }
+    http_parser_init(&parser, HTTP_RESPONSE);
+    parser.data = &relay;
+
+    ret = http_proxy_send(pc->socket, buf, len, 0);
+    while (ret >= 0 && !relay.complete) {
+        size_t parsed;
+        int length = http_proxy_recv(pc->socket, buf, size);
+
+        if (length < 0) {
+            ret = length;
+            break;
+        }
+        if (length == 0) {
+            /* End of file terminates a body without a length */
+            if (received)
+                http_parser_execute(&parser, &proxy_settings, buf, 0);
+            if (!relay.complete)
+                ret = -EPIPE;
+            break;
+        }
+        received = true;
+        parsed = http_parser_execute(&parser, &proxy_settings, buf, length);
+        if (relay.err) {
+            ret = relay.err;
+            break;
+        }
+        if (HTTP_PARSER_ERRNO(&parser) != HPE_OK &&
+            HTTP_PARSER_ERRNO(&parser) != HPE_PAUSED) {
+            pr_err("bad response from upstream %s\n", up->host);
+            ret = -EPROTO;
+            break;
+        }
+        /* Bytes past the response leave the connection out of sync */
+        reusable = parsed == length;
+    }
+    *sent = relay.sent;
+
+    if (relay.complete && ret >= 0 && !relay.err) {
+        *keep_alive = relay.keep_alive;
+        http_proxy_put(pc, reusable && http_should_keep_alive(&parser));
+        ret = 0;
+        goto out;
+    }
+    /* The backend dropped a pooled connection, retry on a new one */
+    if (!received && pc->reused) {
+        http_proxy_put(pc, false);
+        fresh = true;
+        goto retry;
+    }
+    http_proxy_put(pc, false);
+    if (ret >= 0)
+        ret = relay.err ? relay.err : -EPROTO;
+out:
+    kfree(relay.head);
+    return ret;
+}
+
+static int http_proxy_parse(struct http_upstream *up, char *spec)
+{
+    const char *end;
+    u16 port;
+
+    if (!in4_pton(spec, -1, (u8 *) &up->addr.sin_addr.s_addr, ':', &end) ||
+        *end != ':' || kstrtou16(end + 1, 10, &port) || !port)
+        return -EINVAL;
+    up->addr.sin_family = AF_INET;
+    up->addr.sin_port = htons(port);
+    snprintf(up->host, sizeof(up->host), "%pI4:%u", &up->addr.sin_addr,
+             port);
+    spin_lock_init(&up->lock);
+    INIT_LIST_HEAD(&up->idle);
+    up->nr_idle = 0;
+    atomic_set(&up->active, 0);
+    return 0;
+}
+
+int http_proxy_init(const char *spec, unsigned int pool_size, bool least_conn)
+{
+    char *list, *cur, *tok;
+    int err = 0;
+
+    if (!*spec)
+        return 0;
+    list = kstrdup(spec, GFP_KERNEL);
+    if (!list)
+        return -ENOMEM;
+    cur = list;
+    while ((tok = strsep(&cur, ",")) != NULL) {
+        tok = strim(tok);
+        if (!*tok)
+            continue;
+        if (nr_upstreams == UPSTREAM_MAX) {
+            err = -E2BIG;
+            break;
+        }
+        err = http_proxy_parse(&upstreams[nr_upstreams], tok);
+        if (err < 0) {
+            pr_err("bad upstream \"%s\"\n", tok);
+            break;
+        }
+        nr_upstreams++;
+    }
+    kfree(list);
+    if (err < 0) {
+        nr_upstreams = 0;
+        return err;
+    }
+    proxy_pool_size = pool_size;
+    proxy_least_conn = least_conn;
+    atomic_set(&next_upstream, 0);
+    return 0;
+}
+
+void http_proxy_exit(void)
+{
+    struct http_proxy_conn *pc, *tmp;
+    unsigned int i;
+
+    for (i = 0; i < nr_upstreams; i++) {
+        list_for_each_entry_safe (pc, tmp, &upstreams[i].idle, list)
+            http_proxy_release(pc);
+        INIT_LIST_HEAD(&upstreams[i].idle);
+        upstreams[i].nr_idle = 0;
+    }
+    nr_upstreams = 0;
+}
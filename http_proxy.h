@@ -0,0 +1,42 @@
+#ifndef KHTTPD_HTTP_PROXY_H
+#define KHTTPD_HTTP_PROXY_H
+
+#ifdef __KERNEL__
+#include <linux/net.h>
+#else
+#include "compat/user.h"
+#endif
+
+/*
+ * @upstreams is a comma separated list of IPv4 "address:port" backends, each
+ * keeping up to @pool_size idle keep-alive connections for reuse.
+ */
+extern int http_proxy_init(const char *upstreams,
+                           unsigned int pool_size,
+                           bool least_conn);
+extern void http_proxy_exit(void);
+extern bool http_proxy_enabled(void);
+
+/*
+ * Forward a GET of @url, with the extra header lines in @headers, to an
+ * upstream and stream the response to @client as it arrives. @buf is
+ * scratch space of @size bytes. The response head loses the hop-by-hop
+ * headers of the upstream connection and gets a Connection header of its
+ * own; a body without a length is chunked for an @http11 client and sent
+ * as is, the connection closed after it, to an HTTP/1.0 one. @keep_alive
+ * tells whether the client asked to keep the connection open. Returns 0
+ * once the whole response went out, @keep_alive then telling whether the
+ * connection may stay open, or an error; @sent then tells whether part of
+ * the response reached the client.
+ */
+extern int http_proxy_forward(struct socket *client,
+                              const char *url,
+                              size_t url_len,
+                              const char *headers,
+                              char *buf,
+                              size_t size,
+                              bool http11,
+                              bool *keep_alive,
+                              bool *sent);
+
+#endif
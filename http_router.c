@@ -0,0 +1,277 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#ifdef __KERNEL__
+#include <linux/err.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+#else
+#include "compat/user.h"
+#endif
+
+#include "http_router.h"
+
+/*
+ * Radix trie compiled from every registered prefix. Each node consumes its
+ * label, then the next URL character picks one of the children; the
+ * handlers of a node are those whose prefix ends there. The trie is rebuilt
+ * from scratch on every change and swapped under RCU, lookups never lock.
+ */
+struct http_trie_node {
+    const char *label; /* points into the prefix of a handler */
+    size_t label_len;
+    unsigned int nr_children, nr_handlers;
+    struct http_trie_node **children; /* ordered by first label character */
+    struct http_handler **handlers;
+    void *slots[];
+};
+
+static LIST_HEAD(router_handlers);
+static unsigned int router_nr_handlers;
+static DEFINE_MUTEX(router_lock); /* protects the handler list */
+static struct http_trie_node __rcu *router_root;
+
+static void http_trie_free(struct http_trie_node *node)
+{
+    unsigned int i;
+
+    if (!node)
+        return;
+    for (i = 0; i < node->nr_children; i++)
+        http_trie_free(node->children[i]);
+    kfree(node);
+}
+
+static int http_prefix_cmp(const void *a, const void *b)
+{
+    const struct http_handler *const *x = a, *const *y = b;
+
+    return strcmp((*x)->prefix, (*y)->prefix);
+}
+
+/* End of the run of @handlers, from @i on, with the same character at @len */
+static size_t http_trie_group(struct http_handler **handlers,
+                              size_t i,
+                              size_t nr,
+                              size_t len)
+{
+    char c = handlers[i]->prefix[len];
+
+    while (i < nr && handlers[i]->prefix[len] == c)
+        i++;
+    return i;
+}
+
+/*
+ * Build the node for @handlers[0, @nr), sorted, whose prefixes all share
+ * their first @depth characters. Sorted, what the first and last prefixes
+ * have in common is what all of them have.
+ */
+static struct http_trie_node *http_trie_build(struct http_handler **handlers,
+                                              size_t nr,
+                                              size_t depth,
+                                              gfp_t gfp)
+{
+    const char *first = handlers[0]->prefix, *last = handlers[nr - 1]->prefix;
+    size_t len = depth, i, j, nr_handlers = 0, nr_children = 0;
+    struct http_trie_node *node;
+
+    while (first[len] && first[len] == last[len])
+        len++;
+    /* Shorter prefixes sort first, those ending here are handled here */
+    while (nr_handlers < nr && !handlers[nr_handlers]->prefix[len])
+        nr_handlers++;
+    for (i = nr_handlers; i < nr; i = http_trie_group(handlers, i, nr, len))
+        nr_children++;
+
+    node = kzalloc(struct_size(node, slots, nr_children + nr_handlers), gfp);
+    if (!node)
+        return NULL;
+    node->label = first + depth;
+    node->label_len = len - depth;
+    node->children = (struct http_trie_node **) node->slots;
+    node->handlers = (struct http_handler **) node->slots + nr_children;
+    node->nr_handlers = nr_handlers;
+    memcpy(node->handlers, handlers, nr_handlers * sizeof(*handlers));
+    for (i = nr_handlers; i < nr; i = j) {
+        j = http_trie_group(handlers, i, nr, len);
+        node->children[node->nr_children] =
+            http_trie_build(handlers + i, j - i, len, gfp);
+        if (!node->children[node->nr_children]) {
+            http_trie_free(node);
+            return NULL;
+        }
+        node->nr_children++;
+    }
+    return node;
+}
+
+/* Called with router_lock held */
+static int http_router_compile(gfp_t gfp)
+{
+    struct http_trie_node *root = NULL, *old;
+    struct http_handler **handlers, *handler;
+    size_t i = 0;
+
+    if (router_nr_handlers) {
+        handlers = kmalloc_array(router_nr_handlers, sizeof(*handlers), gfp);
+        if (!handlers)
+            return -ENOMEM;
+        list_for_each_entry (handler, &router_handlers, list)
+            handlers[i++] = handler;
+        sort(handlers, i, sizeof(*handlers), http_prefix_cmp, NULL);
+        root = http_trie_build(handlers, i, 0, gfp);
+        kfree(handlers);
+        if (!root)
+            return -ENOMEM;
+    }
+
+    old = rcu_dereference_protected(router_root,
+                                    lockdep_is_held(&router_lock));
+    rcu_assign_pointer(router_root, root);
+    synchronize_rcu();
+    http_trie_free(old);
+    return 0;
+}
+
+/* Prefixes are matched against raw request targets, keep them plain */
+static bool http_prefix_valid(const char *prefix)
+{
+    return prefix && prefix[0] == '/' && !strpbrk(prefix, "?# \t\r\n");
+}
+
+int http_register_handler(struct http_handler *handler)
+{
+    struct http_handler *other;
+    int err;
+
+    if (!http_prefix_valid(handler->prefix) || !handler->handle)
+        return -EINVAL;
+
+    mutex_lock(&router_lock);
+    list_for_each_entry (other, &router_handlers, list) {
+        if (!strcmp(other->prefix, handler->prefix) &&
+            (!other->methods || !handler->methods ||
+             (other->methods & handler->methods))) {
+            err = -EEXIST;
+            goto out;
+        }
+    }
+    list_add_tail(&handler->list, &router_handlers);
+    router_nr_handlers++;
+    err = http_router_compile(GFP_KERNEL);
+    if (err) {
+        list_del(&handler->list);
+        router_nr_handlers--;
+    }
+out:
+    mutex_unlock(&router_lock);
+    return err;
+}
+EXPORT_SYMBOL_GPL(http_register_handler);
+
+void http_unregister_handler(struct http_handler *handler)
+{
+    mutex_lock(&router_lock);
+    list_del(&handler->list);
+    router_nr_handlers--;
+    /* The handler may be freed once this returns, it can't stay in use */
+    http_router_compile(GFP_KERNEL | __GFP_NOFAIL);
+    mutex_unlock(&router_lock);
+}
+EXPORT_SYMBOL_GPL(http_unregister_handler);
+
+static bool http_url_boundary(char c)
+{
+    return !c || c == '/' || c == '?' || c == '#';
+}
+
+/* The URL is not NUL-terminated, past its end reads as if it were */
+static char http_url_at(const char *url, size_t len, size_t pos)
+{
+    return pos < len ? url[pos] : '\0';
+}
+
+size_t http_slice_cspn(const char *p, size_t len, const char *reject)
+{
+    size_t i = 0;
+
+    while (i < len && !strchr(reject, p[i]))
+        i++;
+    return i;
+}
+
+struct http_handler *http_router_lookup(const char *url,
+                                        size_t len,
+                                        enum http_method method,
+                                        struct http_req *req,
+                                        unsigned int *allow)
+{
+    struct http_handler *handler = NULL;
+    struct http_trie_node *node, *match = NULL;
+    size_t pos = 0, matched = 0;
+    unsigned int i;
+    char c;
+
+    rcu_read_lock();
+    node = rcu_dereference(router_root);
+    while (node) {
+        if (node->label_len > len - pos ||
+            memcmp(url + pos, node->label, node->label_len))
+            break;
+        pos += node->label_len;
+        c = http_url_at(url, len, pos);
+        if (node->nr_handlers &&
+            (url[pos - 1] == '/' || http_url_boundary(c))) {
+            match = node;
+            matched = pos;
+        }
+        if (http_url_boundary(c) && c != '/')
+            break;
+        for (i = 0; i < node->nr_children; i++)
+            if (node->children[i]->label[0] == c)
+                break;
+        node = i < node->nr_children ? node->children[i] : NULL;
+    }
+    for (i = 0; match && i < match->nr_handlers; i++) {
+        struct http_handler *h = match->handlers[i];
+        /* The mask has no bit for the methods past 31, such as UNLINK */
+        if (!h->methods ||
+            (method < 32 && (h->methods & (1U << method)))) {
+            handler = h;
+            break;
+        }
+    }
+    /* Only consulted without a handler, all of them are then restricted */
+    for (*allow = 0, i = 0; !handler && match && i < match->nr_handlers; i++)
+        *allow |= match->handlers[i]->methods;
+    /* The owner is unloading, it takes no more requests */
+    if (handler && !try_module_get(handler->owner)) {
+        handler = NULL;
+        match = NULL;
+    }
+    rcu_read_unlock();
+
+    if (!handler)
+        return match ? ERR_PTR(-EOPNOTSUPP) : NULL;
+    req->method = method;
+    req->url = url;
+    req->url_len = len;
+    req->path = url + matched;
+    req->path_len = http_slice_cspn(req->path, len - matched, "?#");
+    req->query = NULL;
+    req->query_len = 0;
+    if (http_url_at(url, len, matched + req->path_len) == '?') {
+        req->query = req->path + req->path_len + 1;
+        req->query_len = http_slice_cspn(
+            req->query, len - matched - req->path_len - 1, "#");
+    }
+    return handler;
+}
+
+void http_router_put(struct http_handler *handler)
+{
+    module_put(handler->owner);
+}
@@ -0,0 +1,85 @@
+#ifndef KHTTPD_HTTP_ROUTER_H
+#define KHTTPD_HTTP_ROUTER_H
+
+#ifdef __KERNEL__
+#include <linux/list.h>
+#include <linux/module.h>
+#else
+#include "compat/user.h"
+#endif
+
+#include "http_parser.h"
+
+struct http_conn;
+
+/*
+ * A request as a handler sees it. Nothing is copied: the strings point into
+ * the request and are only valid while the handler runs.
+ */
+struct http_req {
+    enum http_method method;
+    const char *url;   /* the whole request target, not NUL-terminated */
+    size_t url_len;
+    const char *path;  /* what follows the registered prefix */
+    size_t path_len;   /* up to the query or fragment */
+    const char *query; /* after the '?', NULL without a query */
+    size_t query_len;
+    const char *body;  /* as received, NULL without a body */
+    size_t body_len;
+    int keep_alive;
+    struct http_conn *conn; /* private */
+};
+
+/*
+ * A handler for every path under @prefix, which must start with '/'. A
+ * prefix matches whole segments: "/api" takes "/api" and "/api/v1" but not
+ * "/apis"; "/api/" only takes paths below it. The longest prefix wins.
+ *
+ * @methods is a mask of (1 << HTTP_GET) and the like, 0 takes any method.
+ * Methods numbered 32 and up have no bit: only a handler of any method
+ * takes them.
+ * @handle runs in the worker serving the connection and may sleep, but the
+ * connection waits for it; it answers with http_respond() and returns 0,
+ * or an error to have khttpd answer 500, as it also does when @handle
+ * returns without having responded.
+ */
+struct http_handler {
+    const char *prefix;
+    unsigned int methods;
+    int (*handle)(struct http_req *req, void *data);
+    void *data;
+    struct module *owner; /* pinned while @handle runs */
+    struct list_head list; /* private */
+};
+
+extern int http_register_handler(struct http_handler *handler);
+extern void http_unregister_handler(struct http_handler *handler);
+
+/*
+ * Queue a response to @req. @body, which may be NULL, must come from
+ * kmalloc() or kvmalloc() and is owned by khttpd from now on, even on error.
+ * A request is answered once, -EALREADY if it already was.
+ */
+extern int http_respond(struct http_req *req,
+                        unsigned int status,
+                        const char *content_type,
+                        char *body,
+                        size_t len);
+
+/*
+ * Find the handler for the @len bytes at @url and fill the path and query
+ * of @req. Returns NULL without a match and ERR_PTR(-EOPNOTSUPP) when the
+ * matching prefix is not registered for @method, with the methods it is
+ * registered for in @allow. Release the handler with http_router_put().
+ */
+extern struct http_handler *http_router_lookup(const char *url,
+                                               size_t len,
+                                               enum http_method method,
+                                               struct http_req *req,
+                                               unsigned int *allow);
+extern void http_router_put(struct http_handler *handler);
+
+/* Length of the start of @p[0, @len) free of the characters in @reject */
+extern size_t http_slice_cspn(const char *p, size_t len, const char *reject);
+
+#endif
@@ -1,26 +1,139 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
+#ifdef __KERNEL__
+#include <linux/hashtable.h>
+#include <linux/kfifo.h>
+#include <linux/kref.h>
 #include <linux/kthread.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
 #include <linux/sched/signal.h>
+#include <linux/sort.h>
 #include <linux/tcp.h>
+#include <linux/workqueue.h>
+#include <asm/unaligned.h>
+#else
+#include "compat/user.h"
+#endif
 
+#include "http_cache.h"
+#include "http_file.h"
+#include "http_limit.h"
+#include "http_log.h"
 #include "http_parser.h"
+#include "http_proxy.h"
+#include "http_router.h"
 #include "http_server.h"
+#include "http_stats.h"
+#include "http_timer.h"
+#ifdef __KERNEL__
+#define CREATE_TRACE_POINTS
+#include "http_trace.h"
+#else
+/* No tracepoints in userspace */
+#define trace_khttpd_accept(...) do { } while (0)
+#define trace_khttpd_parse_start(...) do { } while (0)
+#define trace_khttpd_parse_complete(...) do { } while (0)
+#define trace_khttpd_route(...) do { } while (0)
+#define trace_khttpd_compute_start(...) do { } while (0)
+#define trace_khttpd_compute_end(...) do { } while (0)
+#define trace_khttpd_send(...) do { } while (0)
+#define trace_khttpd_close(...) do { } while (0)
+#endif
 #include "bignum.h"
 
 #define CRLF "\r\n"
 
-#define HTTP_RESPONSE_200_DUMMY                                \
-    ""                                                         \
-    "HTTP/1.1 200 OK" CRLF "Server: " KBUILD_MODNAME CRLF      \
-    "Content-Type: text/plain" CRLF "Content-Length: %zu" CRLF \
-    "Connection: Close" CRLF CRLF "%s" CRLF
+/* 200 header template, the Content-Length value goes between head and tail */
+#define HTTP_RESPONSE_200_HEAD                            \
+    ""                                                    \
+    "HTTP/1.1 200 OK" CRLF "Server: " KBUILD_MODNAME CRLF \
+    "Content-Type: text/plain" CRLF "Content-Length: "
 
-#define HTTP_RESPONSE_200_KEEPALIVE_DUMMY                      \
-    ""                                                         \
-    "HTTP/1.1 200 OK" CRLF "Server: " KBUILD_MODNAME CRLF      \
-    "Content-Type: text/plain" CRLF "Content-Length: %zu" CRLF \
-    "Connection: Keep-Alive" CRLF CRLF "%s" CRLF
+/* Same for files, with the Content-Type value first */
+#define HTTP_RESPONSE_200_FILE_HEAD                       \
+    ""                                                    \
+    "HTTP/1.1 200 OK" CRLF "Server: " KBUILD_MODNAME CRLF \
+    "Content-Type: "
+
+/*
+ * Streamed responses, followed by the 200 tail: chunked, or for HTTP/1.0
+ * clients ended by closing the connection
+ */
+#define HTTP_RESPONSE_200_STREAM_HEAD                     \
+    ""                                                    \
+    "HTTP/1.1 200 OK" CRLF "Server: " KBUILD_MODNAME CRLF \
+    "Content-Type: text/plain"
+
+#define HTTP_RESPONSE_200_CHUNKED_HEAD \
+    HTTP_RESPONSE_200_STREAM_HEAD CRLF "Transfer-Encoding: chunked"
+
+#define HTTP_CONTENT_LENGTH CRLF "Content-Length: "
+
+#define HTTP_ETAG CRLF "ETag: "
+
+/* A /fib result never changes, let intermediaries keep each encoding */
+#define HTTP_FIB_CACHE_CONTROL                                   \
+    CRLF "Cache-Control: public, max-age=31536000, immutable" CRLF \
+         "Vary: Accept-Encoding"
+
+#define HTTP_CONTENT_ENCODING CRLF "Content-Encoding: "
+
+#define HTTP_RESPONSE_304_HEAD                                      \
+    ""                                                              \
+    "HTTP/1.1 304 Not Modified" CRLF "Server: " KBUILD_MODNAME CRLF \
+    "ETag: "
+
+#define HTTP_RESPONSE_200_TAIL CRLF "Connection: Close" CRLF CRLF
+
+#define HTTP_RESPONSE_200_KEEPALIVE_TAIL CRLF "Connection: Keep-Alive" CRLF CRLF
+
+#define HTTP_RESPONSE_404                                        \
+    ""                                                           \
+    "HTTP/1.1 404 Not Found" CRLF "Server: " KBUILD_MODNAME CRLF \
+    "Content-Type: text/plain" CRLF "Content-Length: 15" CRLF    \
+    "Connection: Close" CRLF CRLF "404 Not Found" CRLF
+
+#define HTTP_RESPONSE_404_KEEPALIVE                              \
+    ""                                                           \
+    "HTTP/1.1 404 Not Found" CRLF "Server: " KBUILD_MODNAME CRLF \
+    "Content-Type: text/plain" CRLF "Content-Length: 15" CRLF    \
+    "Connection: Keep-Alive" CRLF CRLF "404 Not Found" CRLF
+
+#define HTTP_RESPONSE_502                                          \
+    ""                                                             \
+    "HTTP/1.1 502 Bad Gateway" CRLF "Server: " KBUILD_MODNAME CRLF \
+    "Content-Type: text/plain" CRLF "Content-Length: 17" CRLF      \
+    "Connection: Close" CRLF CRLF "502 Bad Gateway" CRLF
+
+#define HTTP_RESPONSE_502_KEEPALIVE                                \
+    ""                                                             \
+    "HTTP/1.1 502 Bad Gateway" CRLF "Server: " KBUILD_MODNAME CRLF \
+    "Content-Type: text/plain" CRLF "Content-Length: 17" CRLF      \
+    "Connection: Keep-Alive" CRLF CRLF "502 Bad Gateway" CRLF
+
+#define HTTP_RESPONSE_500                                                  \
+    ""                                                                     \
+    "HTTP/1.1 500 Internal Server Error" CRLF "Server: " KBUILD_MODNAME CRLF \
+    "Content-Type: text/plain" CRLF "Content-Length: 27" CRLF              \
+    "Connection: Close" CRLF CRLF "500 Internal Server Error" CRLF
+
+/* Load shedding, sent without ever looking at the request */
+#define HTTP_RESPONSE_503                                                  \
+    ""                                                                     \
+    "HTTP/1.1 503 Service Unavailable" CRLF "Server: " KBUILD_MODNAME CRLF \
+    "Content-Type: text/plain" CRLF "Content-Length: 25" CRLF              \
+    "Retry-After: 1" CRLF "Connection: Close" CRLF CRLF                    \
+    "503 Service Unavailable" CRLF
+
+/* A client over its rate limit, never looked at further */
+#define HTTP_RESPONSE_429                                                \
+    ""                                                                   \
+    "HTTP/1.1 429 Too Many Requests" CRLF "Server: " KBUILD_MODNAME CRLF \
+    "Content-Type: text/plain" CRLF "Content-Length: 23" CRLF            \
+    "Retry-After: 1" CRLF "Connection: Close" CRLF CRLF                  \
+    "429 Too Many Requests" CRLF
 
 #define HTTP_RESPONSE_501                                              \
     ""                                                                 \
@@ -34,309 +147,2978 @@
     "Content-Type: text/plain" CRLF "Content-Length: 21" CRLF          \
     "Connection: KeepAlive" CRLF CRLF "501 Not Implemented" CRLF
 
+#define HTTP_RESPONSE_413                                                \
+    ""                                                                   \
+    "HTTP/1.1 413 Payload Too Large" CRLF "Server: " KBUILD_MODNAME CRLF \
+    "Content-Type: text/plain" CRLF "Content-Length: 23" CRLF            \
+    "Connection: Close" CRLF CRLF "413 Payload Too Large" CRLF
+
+/* A request head that doesn't fit in the receive buffer */
+#define HTTP_RESPONSE_431                                                  \
+    ""                                                                     \
+    "HTTP/1.1 431 Request Header Fields Too Large" CRLF                    \
+    "Server: " KBUILD_MODNAME CRLF "Content-Type: text/plain" CRLF         \
+    "Content-Length: 37" CRLF "Connection: Close" CRLF CRLF               \
+    "431 Request Header Fields Too Large" CRLF
+
 #define RECV_BUFFER_SIZE 4096
+#define BODY_MAX_SIZE (64 * 1024) /* largest request body accepted */
+#define FLUSH_IOVECS 32
+#define FLIGHT_HASH_BITS 6
+#define HEADER_VALUES 4 /* values kept of a repeated header */
+#define LIMIT_FIB_SHIFT 5 /* a rate limit token buys F(32), some 20 us */
+#define WORKERS_PER_CPU_MAX 16 /* nr_workers can be raised up to this */
 
-struct http_request {
+struct http_worker {
+    struct task_struct *task;
+    int cpu;
+    /* Event-driven mode only */
+    spinlock_t lock;         /* protects ready and conns */
+    struct list_head ready;  /* connections with pending socket events */
+    struct list_head conns;  /* every connection owned by this worker */
+    wait_queue_head_t wait;
+    char *buf; /* receive buffer shared by all connections of the worker */
+};
+
+/* Accepted socket, until a connection takes it or it waits for a worker */
+struct http_accepted {
     struct socket *socket;
+    u64 time; /* ktime_get_ns() at accept */
+    struct http_client *client; /* from http_limit_accept(), referenced */
+};
+
+/*
+ * Settings that may change while the server runs. A change publishes a new
+ * copy, readers take whichever is current under rcu_read_lock().
+ */
+struct http_server_config {
+    unsigned int nr_workers; /* the first ones of the pool take connections */
+    unsigned long idle_timeout, header_timeout; /* jiffies, 0: none */
+    unsigned int max_connections;
+    u64 queue_delay; /* ns, 0: unlimited */
+    /* POST /fib/batch: numbers per request and the sum of them */
+    unsigned int batch_max;
+    u64 batch_cost;
+};
+
+/* Worker threads fed with accepted sockets by the daemon */
+struct http_worker_pool {
+    struct http_server_config __rcu *config;
+    struct http_worker *workers; /* room for max_workers, never moved */
+    unsigned int nr_workers;     /* started, parked ones included */
+    unsigned int max_workers;
+    const struct cpumask *cpus; /* new workers go round-robin over these */
+    int last_cpu;
+    bool bind_workers;
+    bool event_driven;
+    atomic_t next_worker;
+    atomic_t nr_connections;
+    /* Admission control: connections not served yet */
+    unsigned int queue_depth;
+    atomic_t nr_queued;
+    /* Blocking mode only */
+    DECLARE_KFIFO_PTR(queue, struct http_accepted);
+    spinlock_t lock;
+    wait_queue_head_t wait;
+    wait_queue_head_t park; /* workers past config->nr_workers */
+};
+
+static struct http_worker_pool pool;
+
+/* Fibonacci cache misses, computed away from the connection workers */
+static struct workqueue_struct *http_compute_wq;
+
+/* Per-connection state and receive buffers, see /proc/slabinfo */
+static struct kmem_cache *http_conn_cachep;
+static struct kmem_cache *http_buf_cachep;
+
+/* Bytes of the request where they were received, never NUL-terminated */
+struct http_slice {
+    const char *p;
+    size_t len;
+};
+
+/* Every value of a header, in order */
+struct http_header {
+    struct http_slice values[HEADER_VALUES];
+    unsigned int nr;
+    bool overflow; /* more values than kept, the header can't be used */
+};
+
+/*
+ * A request as parsed, in place: the slices point into the receive buffer,
+ * or into the connection's reassembly buffer once the request spans several
+ * receives, and stay valid until the response is queued.
+ */
+struct http_request {
     enum http_method method;
-    char request_url[128];
+    struct http_slice url;
+    struct http_slice header_field; /* name of the header being parsed */
+    bool header_value; /* the value of the header is being parsed */
+    bool headers_complete;
+    const char *head_end; /* past the last byte handed to a callback */
+    struct http_header if_none_match;
+    struct http_header accept_encoding;
+    char *body; /* copied as received, up to BODY_MAX_SIZE */
+    size_t body_len, body_size;
+    enum http_route route;
+    long long n;    /* /fib number, -1 for anything else */
+    bool responded; /* the response is queued, later items aren't timed */
+    u64 start;      /* first byte of the request */
+    u64 origin;     /* where first-byte latency counts from */
     int complete;
 };
 
-static int http_server_recv(struct socket *sock, char *buf, size_t size)
+/* Deadline the connection timer currently enforces */
+enum http_conn_timer {
+    HTTP_TIMER_NONE,   /* request being served */
+    HTTP_TIMER_HEADER, /* request started but not complete yet */
+    HTTP_TIMER_IDLE,   /* keep-alive, waiting for the next request */
+};
+
+enum {
+    HTTP_CONN_QUEUED, /* on the ready list of its worker */
+    HTTP_CONN_CLOSING, /* close once the pending output is flushed */
+    HTTP_CONN_CLOSED, /* detached from its worker, never queued again */
+    HTTP_CONN_NEW,    /* counted in pool.nr_queued, never processed yet */
+};
+
+/*
+ * Per-connection state, kept off the worker stack in event-driven mode. The
+ * owner holds a reference and so does every computation in flight for it.
+ */
+struct http_conn {
+    struct kref ref;
+    struct socket *socket;
+    struct http_worker *worker; /* NULL in blocking mode */
+    wait_queue_head_t wait;     /* blocking mode: a computation finished */
+    struct http_parser parser;
+    struct http_request request;
+    unsigned long flags;
+    struct http_timer timer;
+    enum http_conn_timer timer_state;
+    struct list_head node; /* entry in worker->ready */
+    struct list_head link; /* entry in worker->conns */
+    struct list_head out; /* response data the socket could not take yet */
+    struct http_client *client; /* rate limit bucket, NULL: unlimited */
+    struct http_log_record log; /* response being sent, logged once done */
+    /* The part of a request in progress its slices point to, or NULL */
+    char *buf;
+    size_t buf_len;
+    u64 accepted; /* until the first request starts */
+    void (*saved_data_ready)(struct sock *sk);
+    void (*saved_write_space)(struct sock *sk);
+    void (*saved_state_change)(struct sock *sk);
+};
+
+/* Chunked bodies came with HTTP/1.1, older clients can't take them */
+static bool http_conn_chunked_ok(const struct http_conn *conn)
+{
+    return conn->parser.http_major > 1 ||
+           (conn->parser.http_major == 1 && conn->parser.http_minor >= 1);
+}
+
+/*
+ * A queued response: header copied inline, then an optional body. A response
+ * still being computed is a placeholder holding the job, flushing stops there.
+ */
+struct http_out {
+    struct list_head list;
+    struct http_job *job;
+    struct http_cache_entry *entry; /* body sent from the cached pages, */
+    struct http_file *file;         /* from the file's page cache, or */
+    char *body;                     /* owned body buffer */
+    size_t body_len;
+    size_t off; /* bytes of header and body already sent */
+    enum http_route route;
+    u64 start, queued; /* request origin and time queued, for the stats */
+    unsigned short status; /* first item of a response only, for the log */
+    long long n;
+    size_t hdr_len;
+    char hdr[];
+};
+
+/* Codings of the deflated variant of cached bodies, in order of preference */
+enum http_encoding {
+    HTTP_ENCODING_IDENTITY,
+    HTTP_ENCODING_GZIP,
+    HTTP_ENCODING_DEFLATE,
+};
+
+/* What a /fib response depends on, kept for computations finishing later */
+struct http_fib {
+    long long n;
+    enum http_encoding encoding;
+    int keep_alive;
+    char etag[32], etag_encoded[48];
+    size_t etag_len, etag_encoded_len;
+};
+
+/* A /fib cache miss or a batch, computed on http_compute_wq */
+struct http_job {
+    struct work_struct work;
+    struct http_conn *conn;
+    struct http_fib fib;
+    struct http_flight *flight; /* computed by this job */
+    struct list_head waiting;   /* entry in flight->jobs */
+    struct list_head items;     /* the response once done */
+    bool close;                 /* the response ends the connection */
+    bool done;
+    /* Batches only: their items are streamed out before they are done */
+    long long *batch; /* ascending and distinct */
+    bool chunked;     /* else the close ends the response */
+    size_t nr_batch, nr_sent;
+    spinlock_t lock; /* protects items until done */
+};
+
+/*
+ * A /fib computation in flight: requests for the same N that miss the cache
+ * meanwhile join it instead of computing the number once more.
+ */
+struct http_flight {
+    struct hlist_node node;
+    long long n;
+    struct list_head jobs; /* waiting for the number, the first computes it */
+};
+
+static DEFINE_HASHTABLE(http_flights, FLIGHT_HASH_BITS);
+static DEFINE_SPINLOCK(http_flights_lock);
+
+static int http_server_recv(struct socket *sock,
+                            char *buf,
+                            size_t size,
+                            int flags)
 {
     struct kvec iov = {.iov_base = (void *) buf, .iov_len = size};
     struct msghdr msg = {.msg_name = 0,
                          .msg_namelen = 0,
                          .msg_control = NULL,
                          .msg_controllen = 0,
-                         .msg_flags = 0};
+                         .msg_flags = flags};
     return kernel_recvmsg(sock, &msg, &iov, 1, size, msg.msg_flags);
 }
 
-static int http_server_send(struct socket *sock, const char *buf, size_t size)
+/*
+ * Send a gather list with a single kernel_sendmsg() per socket buffer fill,
+ * so header and body leave in the same segments. On return @vec describes
+ * the bytes that were not sent. Returns the bytes sent, or an error if
+ * nothing could be sent.
+ */
+static int http_server_sendv(struct socket *sock,
+                             struct kvec *vec,
+                             size_t nr,
+                             int flags)
 {
     struct msghdr msg = {.msg_name = NULL,
                          .msg_namelen = 0,
                          .msg_control = NULL,
                          .msg_controllen = 0,
-                         .msg_flags = 0};
+                         .msg_flags = flags};
+    size_t i, size = 0;
     int done = 0;
+
+    for (i = 0; i < nr; i++)
+        size += vec[i].iov_len;
     while (done < size) {
-        struct kvec iov = {
-            .iov_base = (void *) ((char *) buf + done), .iov_len = size - done,
-        };
-        int length = kernel_sendmsg(sock, &msg, &iov, 1, iov.iov_len);
+        int length = kernel_sendmsg(sock, &msg, vec, nr, size - done);
         if (length < 0) {
-            pr_err("write error: %d\n", length);
-            break;
+            if (length != -EAGAIN)
+                pr_err("write error: %d\n", length);
+            return done ? done : length;
         }
         done += length;
+        /* Skip what went out, the rest is resent from the same vector */
+        while (nr && length >= vec->iov_len) {
+            length -= vec->iov_len;
+            vec->iov_len = 0;
+            vec++;
+            nr--;
+        }
+        if (nr) {
+            vec->iov_base = (char *) vec->iov_base + length;
+            vec->iov_len -= length;
+        }
     }
     return done;
 }
 
-char *respmsg_edition(char *msg, int keep_alive)
+#ifdef __KERNEL__
+/*
+ * Send bytes [off, size) of a cached response straight from its pages,
+ * adding what went out to @sent. Returns 0, or the error that stopped it.
+ */
+static int http_server_sendpages(struct socket *sock,
+                                 struct http_cache_entry *entry,
+                                 size_t off,
+                                 int flags,
+                                 size_t *sent)
 {
-    char *rpmsg = NULL;
-    int msgl;
-    size_t rpmsglen;
-
-    // Calculate space needed for response message return
-    // KEEPALIVE_DUMMY (105) vs DUMMY(100) -> for avoiding cppcheck false
-    // trigger
-    rpmsglen = keep_alive ? 105 : 100;
+    while (off < entry->size) {
+        struct page *page = entry->pages[off >> PAGE_SHIFT];
+        int offset = offset_in_page(off);
+        size_t size = min_t(size_t, PAGE_SIZE - offset, entry->size - off);
+        int more = off + size < entry->size ? MSG_MORE | MSG_SENDPAGE_NOTLAST
+                                            : 0;
+        int length = kernel_sendpage(sock, page, offset, size, flags | more);
+        if (length < 0) {
+            if (length != -EAGAIN)
+                pr_err("sendpage error: %d\n", length);
+            return length;
+        }
+        *sent += length;
+        off += length;
+    }
+    return 0;
+}
 
-    // Add msg length into needed space
-    rpmsglen += strlen(msg);
+/*
+ * Send bytes [off, size) of a file from its page cache, reading in the pages
+ * that are not there yet. Counts and returns like http_server_sendpages().
+ */
+static int http_server_sendfile(struct socket *sock,
+                                struct http_file *file,
+                                size_t off,
+                                int flags,
+                                size_t *sent)
+{
+    struct address_space *mapping = file->filp->f_mapping;
 
-    // Probing the length of strlen(msg) and add into needed space
-    rpmsg = (char *) kcalloc(strlen(msg) + 1, sizeof(char), GFP_KERNEL);
+    while (off < file->size) {
+        struct page *page;
+        int offset = offset_in_page(off);
+        size_t size = min_t(size_t, PAGE_SIZE - offset, file->size - off);
+        int more = off + size < file->size ? MSG_MORE | MSG_SENDPAGE_NOTLAST
+                                           : 0;
+        int length;
 
-    if (rpmsg == NULL) {
-        pr_err("Allocate space for response message fail...");
-        return NULL;
+        page = read_mapping_page(mapping, off >> PAGE_SHIFT, file->filp);
+        if (IS_ERR(page)) {
+            pr_err("read page error: %ld\n", PTR_ERR(page));
+            return PTR_ERR(page);
+        }
+        length = kernel_sendpage(sock, page, offset, size, flags | more);
+        put_page(page);
+        if (length < 0) {
+            if (length != -EAGAIN)
+                pr_err("sendpage error: %d\n", length);
+            return length;
+        }
+        *sent += length;
+        off += length;
     }
+    return 0;
+}
+#else
+/* Nothing is page-backed in userspace: no response cache, no files */
+static int http_server_sendpages(struct socket *sock,
+                                 struct http_cache_entry *entry,
+                                 size_t off,
+                                 int flags,
+                                 size_t *sent)
+{
+    return -EOPNOTSUPP;
+}
+
+static int http_server_sendfile(struct socket *sock,
+                                struct http_file *file,
+                                size_t off,
+                                int flags,
+                                size_t *sent)
+{
+    return -EOPNOTSUPP;
+}
+#endif
 
-    msgl = snprintf(rpmsg, strlen(msg), "%zu", strlen(msg));
-    if (msgl > 0) {
-        rpmsglen += msgl;
+static void http_out_free_list(struct list_head *list);
+
+static void http_out_free(struct http_out *out)
+{
+    list_del(&out->list);
+    if (out->entry)
+        http_cache_put(out->entry);
+    if (out->file)
+        http_file_put(out->file);
+    if (out->job) {
+        http_out_free_list(&out->job->items);
+        kvfree(out->job->batch);
+        kfree(out->job);
     }
-    kfree(rpmsg);
+    kvfree(out->body);
+    kfree(out);
+}
+
+static void http_out_free_list(struct list_head *list)
+{
+    while (!list_empty(list))
+        http_out_free(list_first_entry(list, struct http_out, list));
+}
 
-    /* Formal allocation for response needed */
-    rpmsg = (char *) kcalloc(rpmsglen, sizeof(char), GFP_KERNEL);
+/* Hand the access log record of the response sent last to the log */
+static void http_conn_log(struct http_conn *conn)
+{
+    if (!conn->log.status)
+        return;
+    http_log_write(&conn->log);
+    conn->log.status = 0;
+}
 
-    /* Compose formal HTTP response */
-    keep_alive
-        ? snprintf(rpmsg, rpmsglen, HTTP_RESPONSE_200_KEEPALIVE_DUMMY,
-                   strlen(msg), msg)
-        : snprintf(rpmsg, rpmsglen, HTTP_RESPONSE_200_DUMMY, strlen(msg), msg);
+static void http_conn_release(struct kref *ref)
+{
+    struct http_conn *conn = container_of(ref, struct http_conn, ref);
 
-    // pr_info("HTTP response snprintf result: %d", msgl);
+    http_conn_log(conn);
+    http_out_free_list(&conn->out);
+    if (conn->buf)
+        kmem_cache_free(http_buf_cachep, conn->buf);
+    kvfree(conn->request.body);
+    http_limit_put(conn->client);
+    kmem_cache_free(http_conn_cachep, conn);
+}
 
-    return rpmsg;
+static void http_conn_put(struct http_conn *conn)
+{
+    kref_put(&conn->ref, http_conn_release);
 }
 
-static int http_server_response(struct http_request *request, int keep_alive)
+/*
+ * Build a response out of the header pieces in @hdr, which are copied, and
+ * a body: @body is owned by the response from now on, even on failure, and
+ * @entry or @file, if any, gets a reference of its own.
+ */
+static struct http_out *http_out_alloc(const struct kvec *hdr,
+                                       size_t nr,
+                                       char *body,
+                                       size_t body_len,
+                                       struct http_cache_entry *entry,
+                                       struct http_file *file)
 {
-    char *response, *url = NULL, *ptr_n, *ptr_i, /*fib_s,*/ *rpmsg = NULL;
-    long long fib_input;
-    int kres;
-    bignum_t *bn_res;
+    struct http_out *out;
+    size_t i, hdr_len = 0;
 
-    /* Allocate string space for url copying */
-    url = (char *) kcalloc(strlen(request->request_url), sizeof(char),
-                           GFP_KERNEL);
+    for (i = 0; i < nr; i++)
+        hdr_len += hdr[i].iov_len;
+    out = kmalloc(struct_size(out, hdr, hdr_len), GFP_KERNEL);
+    if (!out) {
+        kvfree(body);
+        return NULL;
+    }
+    for (i = 0, out->hdr_len = 0; i < nr; i++) {
+        memcpy(out->hdr + out->hdr_len, hdr[i].iov_base, hdr[i].iov_len);
+        out->hdr_len += hdr[i].iov_len;
+    }
+    out->body = body;
+    out->body_len = entry ? entry->size : file ? file->size : body_len;
+    out->entry = entry;
+    if (entry)
+        http_cache_get(entry);
+    /* An empty file has nothing to send from its pages */
+    out->file = file && file->size ? file : NULL;
+    if (out->file)
+        http_file_get(file);
+    out->off = 0;
+    out->job = NULL;
+    out->route = HTTP_ROUTE_NONE;
+    out->start = out->queued = ktime_get_ns();
+    out->status = 0;
+    return out;
+}
 
-    /* Prevent allocation fail case*/
-    if (url == NULL) {
-        pr_err("Allocate url space fail!");
+/* Status code of the response @out starts, 0 if it has no status line */
+static unsigned short http_out_status(const struct http_out *out)
+{
+    const char *code = out->hdr + sizeof("HTTP/1.1 ") - 1;
+
+    if (out->hdr_len < sizeof("HTTP/1.1 200") - 1 ||
+        memcmp(out->hdr, "HTTP/", sizeof("HTTP/") - 1))
+        return 0;
+    return (code[0] - '0') * 100 + (code[1] - '0') * 10 + (code[2] - '0');
+}
 
-        rpmsg = (char *) kcalloc(sizeof("Allocate url space fail!\n"),
-                                 sizeof(char), GFP_KERNEL);
-        strncat(rpmsg, "Allocate url space fail!\n",
-                sizeof("Allocate url space fail!\n"));
-        goto rsp;  // Response allocation error directly
+/* Queue @out behind the responses already pending on @conn */
+static void http_conn_queue(struct http_conn *conn, struct http_out *out)
+{
+    /* Only the first item queued for a request is timed and logged */
+    if (!conn->request.responded) {
+        out->route = conn->request.route;
+        /* A computation in flight turns into a 200 or a 500 */
+        out->status = out->job ? 200 : http_out_status(out);
+        out->n = conn->request.n;
+    } else {
+        out->route = HTTP_ROUTE_NONE;
     }
+    out->start = conn->request.origin;
+    conn->request.responded = true;
+    list_add_tail(&out->list, &conn->out);
+}
 
-    /* Copying URL */
-    strncpy(url, request->request_url + 1, strlen(request->request_url));
-    ptr_n = url;
+/* Allocate and queue a response, see http_out_alloc() */
+static int http_conn_queue_response(struct http_conn *conn,
+                                    const struct kvec *hdr,
+                                    size_t nr,
+                                    char *body,
+                                    size_t body_len,
+                                    struct http_cache_entry *entry,
+                                    struct http_file *file)
+{
+    struct http_out *out = http_out_alloc(hdr, nr, body, body_len, entry, file);
 
-    /* Seperate instruction pattern and requested number pattern */
-    /* Note: ptr_i for instruction pattern, ptr_n for number pattern */
-    ptr_i = strsep(&ptr_n, "/");
+    if (!out) {
+        set_bit(HTTP_CONN_CLOSING, &conn->flags);
+        return -ENOMEM;
+    }
+    http_conn_queue(conn, out);
+    return 0;
+}
 
-    pr_info("sep / -> number: %s, instruction: %s\n", ptr_n, ptr_i);
+/* Move what a batch still running has produced ahead of its placeholder */
+static void http_job_stream(struct http_job *job, struct http_out *out)
+{
+    struct http_out *first;
+    LIST_HEAD(items);
 
-    /* Check if the instruction pattern is matched... */
-    if (strncmp(ptr_i, "fib", 4) == 0) {
-        /* Transfer input number (dec.) to type long long (fit bn_fibonacci(long
-         * long))
-         */
-        kres = kstrtoll(ptr_n, 10, &fib_input);
+    spin_lock(&job->lock);
+    list_splice_init(&job->items, &items);
+    spin_unlock(&job->lock);
+    if (list_empty(&items))
+        return;
+    first = list_first_entry(&items, struct http_out, list);
+    first->route = out->route;
+    first->start = out->start;
+    /* The head now starts the response, the placeholder only continues it */
+    if (out->status) {
+        first->status = http_out_status(first);
+        first->n = out->n;
+    }
+    out->route = HTTP_ROUTE_NONE;
+    out->status = 0;
+    list_splice_tail(&items, &out->list);
+}
 
-        /* Calculate fibonacci number while return success */
-        if (kres == 0) {
-            /* CPU bound task, disable preemption for better performance */
-            // preempt_disable();
+/*
+ * Replace the placeholders of finished computations with their responses,
+ * up to the first one still running: nothing behind it can be sent anyway.
+ */
+static void http_conn_resolve(struct http_conn *conn)
+{
+    struct http_out *out, *tmp, *first;
 
-            /* Calculate fibonacci number */
-            bn_res = bn_fibonacci_fd(fib_input);
+    list_for_each_entry_safe (out, tmp, &conn->out, list) {
+        struct http_job *job = out->job;
 
-            /* Casting bignum_t to string */
-            rpmsg = bn_tostring(&bn_res);
+        if (!job)
+            continue;
+        if (!smp_load_acquire(&job->done)) {
+            if (job->batch)
+                http_job_stream(job, out);
+            break;
+        }
+        if (job->close)
+            set_bit(HTTP_CONN_CLOSING, &conn->flags);
+        if (!list_empty(&job->items)) {
+            first = list_first_entry(&job->items, struct http_out, list);
+            first->route = out->route;
+            first->start = out->start;
+            first->status = out->status ? http_out_status(first) : 0;
+            first->n = out->n;
+            list_splice_init(&job->items, &out->list);
+        } else if (list_first_entry(&conn->out, struct http_out, list) ==
+                   out) {
+            /* All of it was streamed and is out already */
+            http_conn_log(conn);
+        }
+        http_out_free(out);
+    }
+}
 
-            bn_free(&bn_res);
+/* A response item is out: account it to the record of its response */
+static void http_conn_log_sent(struct http_conn *conn,
+                               const struct http_out *out,
+                               u64 now)
+{
+    struct http_log_record *log = &conn->log;
 
-            /* Enable preemption */
-            // preempt_enable();
+    if (!http_log_enabled())
+        return;
+    /* Only left over if the previous response never completed */
+    if (out->status) {
+        http_conn_log(conn);
+        log->time = out->start;
+        log->bytes = 0;
+        log->n = out->n;
+        log->status = out->status;
+        log->route = out->route;
+    }
+    if (!log->status)
+        return;
+    log->bytes += out->hdr_len + out->body_len;
+    log->latency = now - log->time;
+}
 
-        } else {
-            // pr_err("Input to long long fail, fail code: %d", kres);
+/* Account @sent bytes to the oldest responses, freeing completed ones */
+static void http_conn_advance(struct http_conn *conn, size_t sent)
+{
+    while (sent) {
+        struct http_out *out =
+            list_first_entry(&conn->out, struct http_out, list);
+        size_t left = out->hdr_len + out->body_len - out->off;
+        u64 now;
 
-            rpmsg = (char *) kcalloc(
-                sizeof("Input to long long fail, fail code: ") + 5,
-                sizeof(char), GFP_KERNEL);
-            snprintf(rpmsg, sizeof("Input to long long fail, fail code: ") + 5,
-                     "Input to long long fail, fail code: %d\n", kres);
+        if (!out->off)
+            http_stats_record(out->route, HTTP_STAGE_FIRST_BYTE,
+                              ktime_get_ns() - out->start);
+        if (sent < left) {
+            out->off += sent;
+            return;
         }
-
-    } else {
-        rpmsg =
-            (char *) kcalloc(sizeof("Instruction pattern is NOT matched!\n"),
-                             sizeof(char), GFP_KERNEL);
-        strncat(rpmsg, "Instruction pattern is NOT matched!\n",
-                sizeof("Instruction pattern is NOT matched!"));
+        sent -= left;
+        now = ktime_get_ns();
+        http_stats_record(out->route, HTTP_STAGE_SEND, now - out->queued);
+        trace_khttpd_send(conn->socket, out->hdr_len + out->body_len,
+                          now - out->queued);
+        http_conn_log_sent(conn, out, now);
+        http_out_free(out);
+        /* Its response is complete unless more of it is queued behind */
+        if (list_empty(&conn->out) ||
+            list_first_entry(&conn->out, struct http_out, list)->status)
+            http_conn_log(conn);
     }
+}
+
+/*
+ * Send every queued response, in order, with as few calls as possible: the
+ * in-memory parts of consecutive responses are gathered into one sendmsg,
+ * cached and file bodies go out with sendpage, and everything but the final
+ * call is flagged MSG_MORE so a pipelined batch leaves as full segments.
+ * Returns 0 when the queue is drained, the socket is full (MSG_DONTWAIT) or
+ * the next response is still being computed.
+ */
+static int http_conn_flush(struct http_conn *conn, int flags)
+{
+    http_conn_resolve(conn);
+    while (!list_empty(&conn->out)) {
+        struct kvec vec[FLUSH_IOVECS];
+        struct http_out *out = NULL;
+        struct list_head *pos;
+        size_t nr = 0, size = 0, sent;
+        int more, ret;
 
-// Integrate response message to formal HTTP response!
-rsp:
+        list_for_each (pos, &conn->out) {
+            size_t off;
 
-    if (request->method != HTTP_GET)
-        response = keep_alive ? HTTP_RESPONSE_501_KEEPALIVE : HTTP_RESPONSE_501;
-    else
-        response = respmsg_edition(rpmsg, keep_alive);
-
-    /* Response to client while response is not NULL */
-    if (response != NULL)
-        http_server_send(request->socket, response, strlen(response));
-
-    /* Free allocated memory space */
-    if (url != NULL)
-        kfree(url);
-    if (rpmsg != NULL)
-        kfree(rpmsg);
-    if (request->method == HTTP_GET && response != NULL)
-        kfree(response);
+            out = list_entry(pos, struct http_out, list);
+            if (out->job || nr + 2 > ARRAY_SIZE(vec))
+                break;
+            off = out->off;
+            if (off < out->hdr_len) {
+                vec[nr].iov_base = out->hdr + off;
+                vec[nr].iov_len = out->hdr_len - off;
+                size += vec[nr++].iov_len;
+                off = out->hdr_len;
+            }
+            /* A page-backed body ends the batch, it is sent from its pages */
+            if (out->entry || out->file)
+                break;
+            off -= out->hdr_len;
+            if (off < out->body_len) {
+                vec[nr].iov_base = out->body + off;
+                vec[nr].iov_len = out->body_len - off;
+                size += vec[nr++].iov_len;
+            }
+        }
+
+        if (nr) {
+            more = pos != &conn->out ? MSG_MORE : 0;
+            ret = http_server_sendv(conn->socket, vec, nr, flags | more);
+            if (ret < 0)
+                return ret == -EAGAIN ? 0 : ret;
+            http_conn_advance(conn, ret);
+            if (ret < size)
+                return 0;
+        }
+
+        /* @out is the first unsent response once the batch went out */
+        if (pos != &conn->out && out->job)
+            return 0;
+        if (pos != &conn->out && (out->entry || out->file) &&
+            out->off >= out->hdr_len) {
+            more = !list_is_last(&out->list, &conn->out) ? MSG_MORE : 0;
+            size = out->body_len - (out->off - out->hdr_len);
+            sent = 0;
+            if (out->entry)
+                ret = http_server_sendpages(conn->socket, out->entry,
+                                            out->off - out->hdr_len,
+                                            flags | more, &sent);
+            else
+                ret = http_server_sendfile(conn->socket, out->file,
+                                           out->off - out->hdr_len,
+                                           flags | more, &sent);
+            /* Whatever went out before an error is accounted all the same */
+            http_conn_advance(conn, sent);
+            if (ret < 0)
+                return ret == -EAGAIN ? 0 : ret;
+            if (sent < size)
+                return 0;
+        }
+    }
     return 0;
 }
 
-static int http_parser_callback_message_begin(http_parser *parser)
+/* kstrtoll() for a slice: an optional sign, then decimal digits only */
+static int http_slice_to_ll(const char *p, size_t len, long long *res)
 {
-    struct http_request *request = parser->data;
-    struct socket *socket = request->socket;
-    memset(request, 0x00, sizeof(struct http_request));
-    request->socket = socket;
+    unsigned long long limit = LLONG_MAX, val = 0;
+    bool neg = false;
+
+    if (len && (*p == '+' || *p == '-')) {
+        neg = *p++ == '-';
+        len--;
+        limit += neg;
+    }
+    if (!len)
+        return -EINVAL;
+    for (; len; p++, len--) {
+        if (!isdigit(*p))
+            return -EINVAL;
+        if (val > (limit - (*p - '0')) / 10)
+            return -ERANGE;
+        val = val * 10 + (*p - '0');
+    }
+    *res = neg ? (long long) -val : (long long) val;
     return 0;
 }
 
-static int http_parser_callback_request_url(http_parser *parser,
-                                            const char *p,
-                                            size_t len)
+/*
+ * Map a request URL onto a file of the document root: the query string is
+ * dropped and a directory path gets its index.html.
+ */
+static struct http_file *http_server_lookup_file(
+    const struct http_request *request)
 {
-    struct http_request *request = parser->data;
-    strncat(request->request_url, p, len);
-    return 0;
+    const char *url = request->url.p;
+    size_t len = http_slice_cspn(url, request->url.len, "?#");
+    struct http_file *file;
+    char *path;
+
+    if (!len || url[len - 1] != '/')
+        return http_file_lookup(url, len);
+    path = kmalloc(len + sizeof("index.html") - 1, GFP_KERNEL);
+    if (!path)
+        return ERR_PTR(-ENOMEM);
+    memcpy(path, url, len);
+    memcpy(path + len, "index.html", sizeof("index.html") - 1);
+    file = http_file_lookup(path, len + sizeof("index.html") - 1);
+    kfree(path);
+    return file;
 }
 
-static int http_parser_callback_header_field(http_parser *parser,
-                                             const char *p,
-                                             size_t len)
+static const struct {
+    const char *name;
+    const char *head; /* framing around the raw deflate stream */
+    size_t head_len;
+} http_encodings[] = {
+    [HTTP_ENCODING_IDENTITY] = {"identity"},
+    [HTTP_ENCODING_GZIP] = {"gzip", "\x1f\x8b\x08\0\0\0\0\0\0\x03", 10},
+    [HTTP_ENCODING_DEFLATE] = {"deflate", "\x78\x9c", 2},
+};
+
+/* Is "q=" followed by a zero weight, which rules the coding out? */
+static bool http_qvalue_zero(const char *q, const char *end)
 {
-    return 0;
+    if (q == end || *q++ != '0')
+        return false;
+    if (q < end && *q == '.')
+        while (++q < end && *q == '0')
+            ;
+    return q == end || !isdigit(*q);
 }
 
-static int http_parser_callback_header_value(http_parser *parser,
-                                             const char *p,
-                                             size_t len)
+/* Accept-Encoding: the preferred coding of those the client takes */
+static enum http_encoding http_server_encoding(
+    const struct http_request *request)
 {
-    return 0;
+    const struct http_header *header = &request->accept_encoding;
+    bool gzip = false, deflate = false;
+    unsigned int i;
+
+    if (header->overflow)
+        return HTTP_ENCODING_IDENTITY;
+    for (i = 0; i < header->nr; i++) {
+        const char *p = header->values[i].p;
+        const char *end = p + header->values[i].len;
+
+        while (p < end) {
+            size_t len, name_len;
+            const char *q;
+            bool accepted;
+
+            while (p < end && isspace(*p))
+                p++;
+            len = http_slice_cspn(p, end - p, ",");
+            name_len = http_slice_cspn(p, len, "; \t");
+            q = strnstr(p, "q=", len);
+            accepted = !q || !http_qvalue_zero(q + 2, p + len);
+            if ((name_len == 4 && !strncasecmp(p, "gzip", 4)) ||
+                (name_len == 6 && !strncasecmp(p, "x-gzip", 6)))
+                gzip = accepted;
+            else if (name_len == 7 && !strncasecmp(p, "deflate", 7))
+                deflate = accepted;
+            else if (name_len == 1 && *p == '*')
+                gzip = deflate = accepted;
+            p += len;
+            if (p < end)
+                p++;
+        }
+    }
+    return gzip ? HTTP_ENCODING_GZIP
+                : deflate ? HTTP_ENCODING_DEFLATE : HTTP_ENCODING_IDENTITY;
 }
 
-static int http_parser_callback_headers_complete(http_parser *parser)
+/* Fill the framing trailer that follows the deflate stream in @buf */
+static size_t http_encoding_trailer(enum http_encoding encoding,
+                                    const struct http_cache_entry *entry,
+                                    u8 *buf)
 {
-    struct http_request *request = parser->data;
-    request->method = parser->method;
-    return 0;
+    if (encoding == HTTP_ENCODING_GZIP) {
+        put_unaligned_le32(entry->crc32, buf);
+        put_unaligned_le32(entry->size, buf + 4);
+        return 8;
+    }
+    put_unaligned_be32(entry->adler32, buf);
+    return 4;
 }
 
-static int http_parser_callback_body(http_parser *parser,
-                                     const char *p,
-                                     size_t len)
+/* If-None-Match: does the list hold @etag, or "*"? Weak tags compare too */
+static bool http_etag_match(const struct http_request *request,
+                            const char *etag,
+                            size_t etag_len)
 {
-    return 0;
+    const struct http_header *header = &request->if_none_match;
+    unsigned int i;
+
+    if (header->overflow)
+        return false;
+    for (i = 0; i < header->nr; i++) {
+        const char *p = header->values[i].p;
+        const char *end = p + header->values[i].len;
+
+        while (p < end) {
+            size_t len, tag_len;
+            const char *tag;
+
+            while (p < end && isspace(*p))
+                p++;
+            len = http_slice_cspn(p, end - p, ",");
+            tag = p;
+            tag_len = len;
+            while (tag_len && isspace(tag[tag_len - 1]))
+                tag_len--;
+            if (tag_len >= 2 && !strncmp(tag, "W/", 2)) {
+                tag += 2;
+                tag_len -= 2;
+            }
+            if ((tag_len == 1 && *tag == '*') ||
+                (tag_len == etag_len && !memcmp(tag, etag, tag_len)))
+                return true;
+            p += len;
+            if (p < end)
+                p++;
+        }
+    }
+    return false;
 }
 
-static int http_parser_callback_message_complete(http_parser *parser)
+/* 200 header with a Content-Type, the number of pieces put in @vec */
+static size_t http_server_typed_header(struct kvec *vec,
+                                       const char *type,
+                                       char *buf,
+                                       size_t size,
+                                       long long length,
+                                       int keep_alive)
 {
-    struct http_request *request = parser->data;
-    http_server_response(request, http_should_keep_alive(parser));
-    request->complete = 1;
+    vec[0].iov_base = HTTP_RESPONSE_200_FILE_HEAD;
+    vec[0].iov_len = sizeof(HTTP_RESPONSE_200_FILE_HEAD) - 1;
+    vec[1].iov_base = (void *) type;
+    vec[1].iov_len = strlen(type);
+    vec[2].iov_base = HTTP_CONTENT_LENGTH;
+    vec[2].iov_len = sizeof(HTTP_CONTENT_LENGTH) - 1;
+    vec[3].iov_base = buf;
+    vec[3].iov_len = snprintf(buf, size, "%lld", length);
+    vec[4].iov_base =
+        keep_alive ? HTTP_RESPONSE_200_KEEPALIVE_TAIL : HTTP_RESPONSE_200_TAIL;
+    vec[4].iov_len = strlen(vec[4].iov_base);
+    return 5;
+}
+
+/* Forward every value of @header, as far as they fit in @buf */
+static size_t http_proxy_header(char *buf,
+                                size_t size,
+                                const char *name,
+                                const struct http_header *header)
+{
+    size_t len = 0, n;
+    unsigned int i;
+
+    for (i = 0; !header->overflow && i < header->nr; i++) {
+        n = snprintf(buf + len, size - len, "%s: %.*s" CRLF, name,
+                     (int) header->values[i].len, header->values[i].p);
+        /* Dropped, the upstream then just answers in full or uncoded */
+        if (n >= size - len) {
+            buf[len] = '\0';
+            break;
+        }
+        len += n;
+    }
+    return len;
+}
+
+/*
+ * Stream the response of an upstream to the client. It can't be queued like
+ * the others, so whatever is queued ahead of it is flushed first.
+ */
+static int http_server_proxy(struct http_conn *conn,
+                             struct http_request *request,
+                             int keep_alive)
+{
+    struct sockaddr_in peer;
+    char headers[512];
+    size_t len = 0;
+    bool client_keep_alive = keep_alive, sent;
+    char *buf = NULL;
+    struct kvec vec;
+    u64 begin;
+    int ret;
+
+    ret = http_conn_flush(conn, 0);
+    if (ret < 0)
+        goto bail;
+    buf = kmem_cache_alloc(http_buf_cachep, GFP_KERNEL);
+    if (!buf)
+        goto bail;
+
+    headers[0] = '\0';
+    if (kernel_getpeername(conn->socket, (struct sockaddr *) &peer) >= 0)
+        len += scnprintf(headers + len, sizeof(headers) - len,
+                         "X-Forwarded-For: %pI4" CRLF, &peer.sin_addr);
+    len += http_proxy_header(headers + len, sizeof(headers) - len,
+                             "Accept-Encoding", &request->accept_encoding);
+    len += http_proxy_header(headers + len, sizeof(headers) - len,
+                             "If-None-Match", &request->if_none_match);
+
+    http_stats_request(HTTP_ROUTE_PROXY);
+    trace_khttpd_route(conn->socket, HTTP_ROUTE_PROXY);
+    begin = ktime_get_ns();
+    ret = http_proxy_forward(conn->socket, request->url.p, request->url.len,
+                             headers, buf, RECV_BUFFER_SIZE,
+                             http_conn_chunked_ok(conn), &client_keep_alive,
+                             &sent);
+    kmem_cache_free(http_buf_cachep, buf);
+    http_stats_record(HTTP_ROUTE_PROXY, HTTP_STAGE_SEND,
+                      ktime_get_ns() - begin);
+    if (ret < 0)
+        http_stats_error(HTTP_ROUTE_PROXY);
+    if (ret < 0 && !sent) {
+        vec.iov_base =
+            keep_alive ? HTTP_RESPONSE_502_KEEPALIVE : HTTP_RESPONSE_502;
+        vec.iov_len = strlen(vec.iov_base);
+        http_conn_queue_response(conn, &vec, 1, NULL, 0, NULL, NULL);
+        return 0;
+    }
+    /* Half a response, or one that only the close ends */
+    if (ret < 0 || !client_keep_alive)
+        goto bail;
+    return 0;
+
+bail:
+    set_bit(HTTP_CONN_CLOSING, &conn->flags);
     return 0;
 }
 
-static int http_server_worker(void *arg)
+/*
+ * Build a 200 response with a text body, @rpmsg or the cached @entry, into
+ * @items. Cached bodies may go out as their precompressed variant, with the
+ * framing trailer as a separate body-less item. @rpmsg is owned from now on.
+ */
+static int http_fib_response(struct list_head *items,
+                             struct http_fib *fib,
+                             struct http_cache_entry *entry,
+                             char *rpmsg)
 {
-    char *buf;
-    struct http_parser parser;
-    struct http_parser_settings setting = {
-        .on_message_begin = http_parser_callback_message_begin,
-        .on_url = http_parser_callback_request_url,
-        .on_header_field = http_parser_callback_header_field,
-        .on_header_value = http_parser_callback_header_value,
-        .on_headers_complete = http_parser_callback_headers_complete,
-        .on_body = http_parser_callback_body,
-        .on_message_complete = http_parser_callback_message_complete};
-    struct http_request request;
-    struct socket *socket = (struct socket *) arg;
+    enum http_encoding encoding = fib->encoding;
+    struct http_cache_entry *body = entry;
+    char content_length[24];
+    char *etag = fib->etag;
+    size_t etag_len = fib->etag_len, trailer_len = 0, nr;
+    struct http_out *out;
+    struct kvec vec[10];
+    u8 trailer[8];
 
-    allow_signal(SIGKILL);
-    allow_signal(SIGTERM);
+    if (entry && entry->deflated && encoding != HTTP_ENCODING_IDENTITY) {
+        body = entry->deflated;
+        trailer_len = http_encoding_trailer(encoding, entry, trailer);
+        etag = fib->etag_encoded;
+        etag_len = fib->etag_encoded_len;
+    } else {
+        encoding = HTTP_ENCODING_IDENTITY;
+    }
 
-    buf = kmalloc(RECV_BUFFER_SIZE, GFP_KERNEL);
-    if (!buf) {
-        pr_err("can't allocate memory!\n");
-        return -1;
+    /* Static header template around the length, body sent in place */
+    vec[0].iov_base = HTTP_RESPONSE_200_HEAD;
+    vec[0].iov_len = sizeof(HTTP_RESPONSE_200_HEAD) - 1;
+    vec[1].iov_base = content_length;
+    vec[1].iov_len =
+        snprintf(content_length, sizeof(content_length), "%zu",
+                 (body ? body->size : strlen(rpmsg)) +
+                     http_encodings[encoding].head_len + trailer_len);
+    nr = 2;
+    if (encoding != HTTP_ENCODING_IDENTITY) {
+        vec[nr].iov_base = HTTP_CONTENT_ENCODING;
+        vec[nr++].iov_len = sizeof(HTTP_CONTENT_ENCODING) - 1;
+        vec[nr].iov_base = (void *) http_encodings[encoding].name;
+        vec[nr++].iov_len = strlen(http_encodings[encoding].name);
+    }
+    if (etag_len) {
+        vec[nr].iov_base = HTTP_ETAG;
+        vec[nr++].iov_len = sizeof(HTTP_ETAG) - 1;
+        vec[nr].iov_base = etag;
+        vec[nr++].iov_len = etag_len;
+        vec[nr].iov_base = HTTP_FIB_CACHE_CONTROL;
+        vec[nr++].iov_len = sizeof(HTTP_FIB_CACHE_CONTROL) - 1;
+    }
+    vec[nr].iov_base = fib->keep_alive ? HTTP_RESPONSE_200_KEEPALIVE_TAIL
+                                       : HTTP_RESPONSE_200_TAIL;
+    vec[nr].iov_len = strlen(vec[nr].iov_base);
+    nr++;
+    if (http_encodings[encoding].head_len) {
+        vec[nr].iov_base = (void *) http_encodings[encoding].head;
+        vec[nr++].iov_len = http_encodings[encoding].head_len;
     }
 
-    request.socket = socket;
-    http_parser_init(&parser, HTTP_REQUEST);
-    parser.data = &request;
-    /* Blocking receiving */
-    while (!kthread_should_stop()) {
-        int ret = http_server_recv(socket, buf, RECV_BUFFER_SIZE - 1);
-        if (ret <= 0) {
-            if (ret)
-                pr_err("recv error: %d\n", ret);
-            break;
-        }
-        http_parser_execute(&parser, &setting, buf, ret);
-        if (request.complete && !http_should_keep_alive(&parser))
-            break;
+    if (body)
+        out = http_out_alloc(vec, nr, NULL, 0, body, NULL);
+    else
+        out = http_out_alloc(vec, nr, rpmsg, strlen(rpmsg), NULL, NULL);
+    if (!out)
+        return -ENOMEM;
+    list_add_tail(&out->list, items);
+    if (trailer_len) {
+        vec[0].iov_base = trailer;
+        vec[0].iov_len = trailer_len;
+        out = http_out_alloc(vec, 1, NULL, 0, NULL, NULL);
+        if (!out)
+            return -ENOMEM;
+        list_add_tail(&out->list, items);
     }
-    kernel_sock_shutdown(socket, SHUT_RDWR);
-    sock_release(socket);
-    kfree(buf);
     return 0;
 }
 
-int http_server_daemon(void *arg)
+/* A computation finished, get its connection flushed again */
+static void http_conn_wake(struct http_conn *conn)
 {
-    struct socket *socket;
-    struct task_struct *worker;
-    struct http_server_param *param = (struct http_server_param *) arg;
+    struct http_worker *worker = conn->worker;
 
-    allow_signal(SIGKILL);
-    allow_signal(SIGTERM);
+    if (!worker) {
+        wake_up(&conn->wait);
+        return;
+    }
+    /* Serialized with http_conn_close() on the worker lock */
+    spin_lock_bh(&worker->lock);
+    if (!test_bit(HTTP_CONN_CLOSED, &conn->flags) &&
+        !test_and_set_bit(HTTP_CONN_QUEUED, &conn->flags))
+        list_add_tail(&conn->node, &worker->ready);
+    spin_unlock_bh(&worker->lock);
+    wake_up(&worker->wait);
+}
 
-    while (!kthread_should_stop()) {
-        // Accept connection via kernel socket API
-        int err = kernel_accept(param->listen_socket, &socket, 0);
-        if (err < 0) {
-            if (signal_pending(current))
-                break;
-            pr_err("kernel_accept() error: %d\n", err);
-            continue;
-        }
-        // Create a kernel thread for request handling - callback:
-        // http_server_worker
-        worker = kthread_run(http_server_worker, socket, KBUILD_MODNAME);
-        if (IS_ERR(worker)) {
-            pr_err("can't create more worker process\n");
-            continue;
+/* Build the response of @job out of @entry or @rpmsg, which it owns */
+static void http_job_finish(struct http_job *job,
+                            struct http_cache_entry *entry,
+                            char *rpmsg)
+{
+    struct http_conn *conn = job->conn;
+    struct http_out *out;
+    struct kvec vec;
+
+    if (rpmsg || entry) {
+        if (http_fib_response(&job->items, &job->fib, entry, rpmsg) < 0)
+            job->close = true;
+    } else {
+        vec.iov_base = HTTP_RESPONSE_500;
+        vec.iov_len = sizeof(HTTP_RESPONSE_500) - 1;
+        out = http_out_alloc(&vec, 1, NULL, 0, NULL, NULL);
+        if (out)
+            list_add_tail(&out->list, &job->items);
+        http_stats_error(HTTP_ROUTE_FIB);
+        job->close = true;
+    }
+
+    /* The connection worker takes the response, and may free @job, now */
+    smp_store_release(&job->done, true);
+    http_conn_wake(conn);
+    http_conn_put(conn);
+}
+
+static void http_job_work(struct work_struct *work)
+{
+    struct http_job *job = container_of(work, struct http_job, work), *tmp;
+    struct http_flight *flight = job->flight;
+    struct http_cache_entry *entry = NULL;
+    bignum_t *bn_res;
+    char *rpmsg, *body;
+    size_t len;
+    u64 begin;
+
+    trace_khttpd_compute_start(flight->n);
+    begin = ktime_get_ns();
+    bn_res = bn_fibonacci_fd(flight->n);
+
+    /* Casting bignum_t to string */
+    rpmsg = bn_tostring(&bn_res);
+    len = rpmsg ? strlen(rpmsg) : 0;
+
+    bn_free(&bn_res);
+    http_stats_record(HTTP_ROUTE_FIB, HTTP_STAGE_COMPUTE,
+                      ktime_get_ns() - begin);
+    trace_khttpd_compute_end(flight->n, len);
+
+    if (rpmsg != NULL) {
+        entry = http_cache_insert(flight->n, rpmsg, len);
+        /* Uncacheable, the bodies go out of their own buffers */
+        if (entry) {
+            kfree(rpmsg);
+            rpmsg = NULL;
         }
     }
-    return 0;
+
+    /* Nobody joins from now on, answer everyone who did */
+    spin_lock(&http_flights_lock);
+    hash_del(&flight->node);
+    spin_unlock(&http_flights_lock);
+    list_for_each_entry_safe (job, tmp, &flight->jobs, waiting) {
+        list_del(&job->waiting);
+        body = NULL;
+        if (rpmsg)
+            body = list_empty(&flight->jobs) ? rpmsg
+                                             : kstrdup(rpmsg, GFP_KERNEL);
+        http_job_finish(job, entry, body);
+    }
+    if (entry)
+        http_cache_put(entry);
+    kfree(flight);
+}
+
+static struct http_flight *http_flight_find(long long n)
+{
+    struct http_flight *flight;
+
+    hash_for_each_possible (http_flights, flight, node, n)
+        if (flight->n == n)
+            return flight;
+    return NULL;
+}
+
+/* The client is over its rate limit: 429 and hang up, nothing is computed */
+static void http_conn_throttle(struct http_conn *conn)
+{
+    struct kvec vec = {.iov_base = HTTP_RESPONSE_429,
+                       .iov_len = sizeof(HTTP_RESPONSE_429) - 1};
+
+    http_conn_queue_response(conn, &vec, 1, NULL, 0, NULL, NULL);
+    http_stats_error(conn->request.route);
+    http_stats_count(HTTP_STAT_THROTTLED);
+    set_bit(HTTP_CONN_CLOSING, &conn->flags);
+}
+
+/*
+ * Rate limit tokens computing F(@n) is worth, on top of the token of the
+ * request: its digits are multiplied schoolbook, so the work grows with the
+ * square of N. Saturates at U32_MAX, the limiter caps it at the burst.
+ */
+static u64 http_fib_cost(long long n)
+{
+    u64 units;
+
+    /* Answered without ever reaching the bignum code */
+    if (n < 0)
+        return 0;
+    units = n >> LIMIT_FIB_SHIFT;
+
+    return units >> 16 ? U32_MAX : units * units;
+}
+
+/*
+ * Queue a placeholder for the response to @fib and hand its computation to
+ * http_compute_wq, so the worker is free to serve other connections, and
+ * the pipelined requests behind this one, meanwhile. The request joins the
+ * computation of the same number already in flight, if any, or is charged
+ * for starting one.
+ */
+static void http_conn_compute(struct http_conn *conn, struct http_fib *fib)
+{
+    struct http_flight *flight, *joined;
+    struct http_job *job;
+    struct http_out *out;
+    struct kvec vec;
+
+    job = kzalloc(sizeof(*job), GFP_KERNEL);
+    flight = kmalloc(sizeof(*flight), GFP_KERNEL);
+    out = job && flight ? http_out_alloc(NULL, 0, NULL, 0, NULL, NULL) : NULL;
+    if (!out) {
+        kfree(job);
+        kfree(flight);
+        vec.iov_base = HTTP_RESPONSE_500;
+        vec.iov_len = sizeof(HTTP_RESPONSE_500) - 1;
+        http_conn_queue_response(conn, &vec, 1, NULL, 0, NULL, NULL);
+        http_stats_error(HTTP_ROUTE_FIB);
+        set_bit(HTTP_CONN_CLOSING, &conn->flags);
+        return;
+    }
+    INIT_WORK(&job->work, http_job_work);
+    job->conn = conn;
+    job->fib = *fib;
+    job->flight = NULL;
+    INIT_LIST_HEAD(&job->items);
+    job->close = false;
+    job->done = false;
+
+    spin_lock(&http_flights_lock);
+    joined = http_flight_find(fib->n);
+    /* Only the request that starts the computation pays for it */
+    if (!joined && !http_limit_charge(conn->client, http_fib_cost(fib->n))) {
+        spin_unlock(&http_flights_lock);
+        kfree(out);
+        kfree(job);
+        kfree(flight);
+        http_conn_throttle(conn);
+        return;
+    }
+    kref_get(&conn->ref);
+    out->job = job;
+    http_conn_queue(conn, out);
+    if (joined) {
+        list_add_tail(&job->waiting, &joined->jobs);
+        spin_unlock(&http_flights_lock);
+        kfree(flight);
+        http_stats_count(HTTP_STAT_COALESCED);
+        return;
+    }
+    flight->n = fib->n;
+    INIT_LIST_HEAD(&flight->jobs);
+    list_add_tail(&job->waiting, &flight->jobs);
+    hash_add(http_flights, &flight->node, fib->n);
+    spin_unlock(&http_flights_lock);
+
+    job->flight = flight;
+    http_stats_count(HTTP_STAT_COMPUTED);
+    /* On the node of the worker, where the number is sent from */
+    queue_work_node(conn->worker ? cpu_to_node(conn->worker->cpu)
+                                 : numa_node_id(),
+                    http_compute_wq, &job->work);
+}
+
+/* Queue a text response built by http_fib_response(), 500 without a body */
+static void http_conn_queue_text(struct http_conn *conn,
+                                 struct http_fib *fib,
+                                 struct http_cache_entry *entry,
+                                 char *rpmsg)
+{
+    struct http_out *out;
+    struct kvec vec;
+    LIST_HEAD(items);
+
+    if (rpmsg == NULL && entry == NULL) {
+        vec.iov_base = HTTP_RESPONSE_500;
+        vec.iov_len = sizeof(HTTP_RESPONSE_500) - 1;
+        http_conn_queue_response(conn, &vec, 1, NULL, 0, NULL, NULL);
+        http_stats_error(conn->request.route);
+        set_bit(HTTP_CONN_CLOSING, &conn->flags);
+        return;
+    }
+    /* Responses are queued and sent in one batch per received buffer */
+    if (http_fib_response(&items, fib, entry, rpmsg) < 0)
+        set_bit(HTTP_CONN_CLOSING, &conn->flags);
+    if (!list_empty(&items)) {
+        out = list_first_entry(&items, struct http_out, list);
+        list_del(&out->list);
+        http_conn_queue(conn, out);
+        list_splice_tail(&items, &conn->out);
+    }
+}
+
+static int http_fib_handle(struct http_req *req, void *data)
+{
+    struct http_conn *conn = req->conn;
+    struct http_request *request = &conn->request;
+    struct http_cache_entry *entry = NULL;
+    struct http_fib fib = {
+        .encoding = http_server_encoding(request),
+        .keep_alive = req->keep_alive,
+    };
+    bool not_modified = false;
+    char *rpmsg = NULL;
+    struct kvec vec[4];
+    int kres;
+
+    request->route = HTTP_ROUTE_FIB;
+    /* Transfer input number (dec.) to type long long (fit bn_fibonacci(long
+     * long))
+     */
+    kres = http_slice_to_ll(req->path, req->path_len, &fib.n);
+    if (kres == 0)
+        request->n = fib.n;
+
+    /* The tags only depend on N, the body format and its coding */
+    if (kres == 0) {
+        fib.etag_len =
+            snprintf(fib.etag, sizeof(fib.etag), "\"fib-%lld-dec\"", fib.n);
+        if (fib.encoding != HTTP_ENCODING_IDENTITY)
+            fib.etag_encoded_len =
+                snprintf(fib.etag_encoded, sizeof(fib.etag_encoded),
+                         "\"fib-%lld-dec-%s\"", fib.n,
+                         http_encodings[fib.encoding].name);
+        /* Small bodies are never deflated, either tag may be current */
+        if (fib.etag_encoded_len &&
+            http_etag_match(request, fib.etag_encoded, fib.etag_encoded_len)) {
+            memcpy(fib.etag, fib.etag_encoded, fib.etag_encoded_len);
+            fib.etag_len = fib.etag_encoded_len;
+            not_modified = true;
+        } else {
+            not_modified = http_etag_match(request, fib.etag, fib.etag_len);
+        }
+    }
+
+    if (not_modified) {
+        /* The client's copy is current, the number is never computed */
+        vec[0].iov_base = HTTP_RESPONSE_304_HEAD;
+        vec[0].iov_len = sizeof(HTTP_RESPONSE_304_HEAD) - 1;
+        vec[1].iov_base = fib.etag;
+        vec[1].iov_len = fib.etag_len;
+        vec[2].iov_base = HTTP_FIB_CACHE_CONTROL;
+        vec[2].iov_len = sizeof(HTTP_FIB_CACHE_CONTROL) - 1;
+        vec[3].iov_base = req->keep_alive ? HTTP_RESPONSE_200_KEEPALIVE_TAIL
+                                          : HTTP_RESPONSE_200_TAIL;
+        vec[3].iov_len = strlen(vec[3].iov_base);
+        return http_conn_queue_response(conn, vec, 4, NULL, 0, NULL, NULL);
+    }
+
+    if (kres != 0) {
+        // pr_err("Input to long long fail, fail code: %d", kres);
+        http_stats_error(HTTP_ROUTE_FIB);
+
+        rpmsg = (char *) kcalloc(
+            sizeof("Input to long long fail, fail code: ") + 5, sizeof(char),
+            GFP_KERNEL);
+        if (rpmsg)
+            snprintf(rpmsg, sizeof("Input to long long fail, fail code: ") + 5,
+                     "Input to long long fail, fail code: %d\n", kres);
+        fib.etag_len = 0;
+        http_conn_queue_text(conn, &fib, NULL, rpmsg);
+        return 0;
+    }
+
+    /* Serve repeated numbers from the response cache */
+    entry = http_cache_lookup(fib.n);
+    if (entry == NULL) {
+        /* Calculate fibonacci number off this worker */
+        http_conn_compute(conn, &fib);
+        return 0;
+    }
+    http_conn_queue_text(conn, &fib, entry, NULL);
+    http_cache_put(entry);
+    return 0;
+}
+
+/* Queue a piece of a batch response and get it sent */
+static int http_batch_queue(struct http_job *job,
+                            const struct kvec *hdr,
+                            size_t nr,
+                            char *body,
+                            size_t len)
+{
+    struct http_out *out = http_out_alloc(hdr, nr, body, len, NULL, NULL);
+
+    if (!out)
+        return -ENOMEM;
+    spin_lock(&job->lock);
+    list_add_tail(&out->list, &job->items);
+    spin_unlock(&job->lock);
+    http_conn_wake(job->conn);
+    return 0;
+}
+
+/*
+ * One chunk per number, "N: F(N)\n". The line feed, and the CRLF ending the
+ * chunk, go out with the header of the next chunk so the digits need no copy.
+ * Unchunked, only the line feed does.
+ */
+static int http_batch_emit(long long n, bignum_t *f, void *data)
+{
+    struct http_job *job = data;
+    char hdr[64], *digits;
+    size_t len, prefix;
+    struct kvec vec;
+
+    /* Nobody is left to send the rest to */
+    if (test_bit(HTTP_CONN_CLOSED, &job->conn->flags))
+        return -ECONNRESET;
+    digits = bn_tostring(&f);
+    if (!digits)
+        return -ENOMEM;
+    len = strlen(digits);
+    prefix = snprintf(NULL, 0, "%lld: ", n);
+    vec.iov_base = hdr;
+    if (job->chunked)
+        vec.iov_len =
+            snprintf(hdr, sizeof(hdr), "%s%zx" CRLF "%lld: ",
+                     job->nr_sent ? "\n" CRLF : "", prefix + len + 1, n);
+    else
+        vec.iov_len = snprintf(hdr, sizeof(hdr), "%s%lld: ",
+                               job->nr_sent ? "\n" : "", n);
+    job->nr_sent++;
+    return http_batch_queue(job, &vec, 1, digits, len);
+}
+
+static void http_batch_work(struct work_struct *work)
+{
+    struct http_job *job = container_of(work, struct http_job, work);
+    struct http_conn *conn = job->conn;
+    struct kvec vec;
+    u64 begin;
+    int err;
+
+    begin = ktime_get_ns();
+    err = bn_fibonacci_batch(job->batch, job->nr_batch, http_batch_emit, job);
+    http_stats_record(HTTP_ROUTE_FIB, HTTP_STAGE_COMPUTE,
+                      ktime_get_ns() - begin);
+    if (!err) {
+        vec.iov_base = job->chunked ? "\n" CRLF "0" CRLF CRLF : "\n";
+        vec.iov_len = strlen(vec.iov_base);
+        err = http_batch_queue(job, &vec, 1, NULL, 0);
+    }
+    /* Too late for an error status, the stream is cut short instead */
+    if (err) {
+        http_stats_error(HTTP_ROUTE_FIB);
+        job->close = true;
+    }
+
+    smp_store_release(&job->done, true);
+    http_conn_wake(conn);
+    http_conn_put(conn);
+}
+
+/* Parse the list of N in @p into @batch, unless NULL; returns how many */
+static long http_batch_parse(const char *p, size_t len, long long *batch)
+{
+    const char *end = p + len, *next;
+    long nr = 0;
+    size_t tok;
+
+    for (; p < end; p = next) {
+        tok = http_slice_cspn(p, end - p, ",\n");
+        next = p + tok < end ? p + tok + 1 : end;
+        while (tok && isspace(*p)) {
+            p++;
+            tok--;
+        }
+        while (tok && isspace(p[tok - 1]))
+            tok--;
+        if (!tok)
+            continue;
+        if (batch &&
+            (http_slice_to_ll(p, tok, &batch[nr]) || batch[nr] < 0))
+            return -EINVAL;
+        nr++;
+    }
+    return nr;
+}
+
+static int http_batch_cmp(const void *a, const void *b)
+{
+    long long x = *(const long long *) a, y = *(const long long *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int http_batch_error(struct http_req *req,
+                            unsigned int status,
+                            const char *msg)
+{
+    char *body = kstrdup(msg, GFP_KERNEL);
+
+    return http_respond(req, status, NULL, body, body ? strlen(body) : 0);
+}
+
+/*
+ * POST /fib/batch: N separated by newlines or commas, answered in one
+ * chunked response with a line per distinct N, in ascending order, each
+ * sent as soon as it is computed. HTTP/1.0 clients get the lines unframed,
+ * the connection closed after the last.
+ */
+static int http_batch_handle(struct http_req *req, void *data)
+{
+    const struct http_server_config *config;
+    struct http_conn *conn = req->conn;
+    u64 cost = 0, max_cost;
+    unsigned int max;
+    long long *batch;
+    struct http_job *job;
+    struct http_out *out;
+    bool chunked = http_conn_chunked_ok(conn);
+    struct kvec vec[2];
+    size_t i, nr;
+    long ret;
+
+    rcu_read_lock();
+    config = rcu_dereference(pool.config);
+    max = config->batch_max;
+    max_cost = config->batch_cost;
+    rcu_read_unlock();
+
+    conn->request.route = HTTP_ROUTE_FIB;
+    ret = http_batch_parse(req->body, req->body_len, NULL);
+    if (!ret)
+        return http_batch_error(req, 400, "No numbers given\n");
+    if (ret > max)
+        return http_batch_error(req, 413, "Too many numbers\n");
+    batch = kvmalloc_array(ret, sizeof(*batch), GFP_KERNEL);
+    if (!batch)
+        return -ENOMEM;
+    if (http_batch_parse(req->body, req->body_len, batch) < 0) {
+        kvfree(batch);
+        return http_batch_error(req, 400, "Invalid number\n");
+    }
+
+    sort(batch, ret, sizeof(*batch), http_batch_cmp, NULL);
+    for (i = nr = 0; i < ret; i++)
+        if (!nr || batch[i] != batch[nr - 1])
+            batch[nr++] = batch[i];
+    for (i = 0; i < nr; i++) {
+        if (batch[i] > max_cost - cost) {
+            kvfree(batch);
+            return http_batch_error(req, 413, "Too costly\n");
+        }
+        cost += batch[i];
+    }
+    /* Charged as if every number was computed on its own */
+    for (i = 0, cost = 0; i < nr; i++)
+        cost += http_fib_cost(batch[i]);
+    if (!http_limit_charge(conn->client, cost)) {
+        kvfree(batch);
+        http_conn_throttle(conn);
+        return 0;
+    }
+
+    job = kzalloc(sizeof(*job), GFP_KERNEL);
+    out = job ? http_out_alloc(NULL, 0, NULL, 0, NULL, NULL) : NULL;
+    vec[0].iov_base = chunked ? HTTP_RESPONSE_200_CHUNKED_HEAD
+                              : HTTP_RESPONSE_200_STREAM_HEAD;
+    vec[0].iov_len = strlen(vec[0].iov_base);
+    vec[1].iov_base = chunked && req->keep_alive
+                          ? HTTP_RESPONSE_200_KEEPALIVE_TAIL
+                          : HTTP_RESPONSE_200_TAIL;
+    vec[1].iov_len = strlen(vec[1].iov_base);
+    if (!out || http_conn_queue_response(conn, vec, 2, NULL, 0, NULL, NULL)) {
+        kfree(out);
+        kfree(job);
+        kvfree(batch);
+        return -ENOMEM;
+    }
+
+    INIT_WORK(&job->work, http_batch_work);
+    kref_get(&conn->ref);
+    job->conn = conn;
+    INIT_LIST_HEAD(&job->items);
+    spin_lock_init(&job->lock);
+    job->batch = batch;
+    job->nr_batch = nr;
+    job->chunked = chunked;
+    job->close = !chunked;
+    out->job = job;
+    http_conn_queue(conn, out);
+    http_stats_count(HTTP_STAT_COMPUTED);
+    queue_work_node(conn->worker ? cpu_to_node(conn->worker->cpu)
+                                 : numa_node_id(),
+                    http_compute_wq, &job->work);
+    return 0;
+}
+
+static int http_stats_handle(struct http_req *req, void *data)
+{
+    struct http_conn *conn = req->conn;
+    char content_length[24];
+    struct kvec vec[5];
+    size_t len, nr;
+    char *stats;
+
+    conn->request.route = HTTP_ROUTE_STATS;
+    stats = http_stats_format(&len);
+    if (!stats)
+        return -ENOMEM;
+    nr = http_server_typed_header(vec, "application/json", content_length,
+                                  sizeof(content_length), len, req->keep_alive);
+    return http_conn_queue_response(conn, vec, nr, stats, len, NULL, NULL);
+}
+
+/* Endpoints of khttpd itself, routed like the ones other modules register */
+static struct http_handler http_builtin_handlers[] = {
+    {
+        .prefix = "/fib/",
+        .methods = 1U << HTTP_GET,
+        .handle = http_fib_handle,
+    },
+    {
+        .prefix = "/fib/batch",
+        .methods = 1U << HTTP_POST,
+        .handle = http_batch_handle,
+    },
+    {
+        .prefix = "/stats",
+        .methods = 1U << HTTP_GET,
+        .handle = http_stats_handle,
+    },
+};
+
+static const struct {
+    unsigned int status;
+    const char *reason;
+} http_reasons[] = {
+    {200, "OK"},
+    {201, "Created"},
+    {202, "Accepted"},
+    {204, "No Content"},
+    {301, "Moved Permanently"},
+    {302, "Found"},
+    {303, "See Other"},
+    {304, "Not Modified"},
+    {307, "Temporary Redirect"},
+    {400, "Bad Request"},
+    {403, "Forbidden"},
+    {404, "Not Found"},
+    {405, "Method Not Allowed"},
+    {409, "Conflict"},
+    {413, "Payload Too Large"},
+    {429, "Too Many Requests"},
+    {500, "Internal Server Error"},
+    {501, "Not Implemented"},
+    {502, "Bad Gateway"},
+    {503, "Service Unavailable"},
+};
+
+int http_respond(struct http_req *req,
+                 unsigned int status,
+                 const char *content_type,
+                 char *body,
+                 size_t len)
+{
+    const char *reason = "";
+    char head[256];
+    struct kvec vec;
+    size_t i;
+
+    if (req->conn->request.responded) {
+        kvfree(body);
+        return -EALREADY;
+    }
+    if (status < 100 || status > 999 ||
+        (content_type && strpbrk(content_type, "\r\n"))) {
+        kvfree(body);
+        return -EINVAL;
+    }
+    for (i = 0; i < ARRAY_SIZE(http_reasons); i++)
+        if (http_reasons[i].status == status)
+            reason = http_reasons[i].reason;
+    vec.iov_base = head;
+    vec.iov_len = snprintf(
+        head, sizeof(head),
+        "HTTP/1.1 %u %s" CRLF "Server: " KBUILD_MODNAME CRLF
+        "Content-Type: %s" CRLF "Content-Length: %zu" CRLF
+        "Connection: %s" CRLF CRLF,
+        status, reason, content_type ? content_type : "text/plain", len,
+        req->keep_alive ? "Keep-Alive" : "Close");
+    if (vec.iov_len >= sizeof(head)) {
+        kvfree(body);
+        return -EINVAL;
+    }
+    if (status >= 400)
+        http_stats_error(req->conn->request.route);
+    return http_conn_queue_response(req->conn, &vec, 1, body, len, NULL,
+                                    NULL);
+}
+EXPORT_SYMBOL_GPL(http_respond);
+
+/* A path only registered for other methods, the ones in @allow */
+static void http_server_not_allowed(struct http_conn *conn,
+                                    unsigned int allow,
+                                    int keep_alive)
+{
+    const char *sep = " ";
+    char head[512];
+    struct kvec vec;
+    size_t len;
+    int method;
+
+    len = scnprintf(head, sizeof(head),
+                    "HTTP/1.1 405 Method Not Allowed" CRLF
+                    "Server: " KBUILD_MODNAME CRLF "Allow:");
+    for (method = 0; method < 32; method++) {
+        if (!(allow & (1U << method)))
+            continue;
+        len += scnprintf(head + len, sizeof(head) - len, "%s%s", sep,
+                         http_method_str(method));
+        sep = ", ";
+    }
+    len += scnprintf(head + len, sizeof(head) - len,
+                     CRLF "Content-Type: text/plain" CRLF
+                     "Content-Length: 24" CRLF "Connection: %s" CRLF CRLF
+                     "405 Method Not Allowed" CRLF,
+                     keep_alive ? "Keep-Alive" : "Close");
+    vec.iov_base = head;
+    vec.iov_len = len;
+    http_conn_queue_response(conn, &vec, 1, NULL, 0, NULL, NULL);
+    http_stats_error(conn->request.route);
+}
+
+static int http_server_response(struct http_request *request, int keep_alive)
+{
+    struct http_conn *conn = container_of(request, struct http_conn, request);
+    struct http_file *file = NULL;
+    struct http_handler *handler;
+    struct http_fib text = {.keep_alive = keep_alive};
+    char content_length[24];
+    struct http_req req;
+    struct kvec vec[5];
+    unsigned int allow;
+    char *rpmsg;
+    size_t nr;
+    int ret;
+
+    /* Every request takes a token, computations what they are worth */
+    if (!http_limit_charge(conn->client, 1)) {
+        request->route = HTTP_ROUTE_NONE;
+        http_conn_throttle(conn);
+        return 0;
+    }
+
+    /* One pass over the URL, in place, finds the registered handler */
+    request->route = HTTP_ROUTE_OTHER;
+    handler = http_router_lookup(request->url.p, request->url.len,
+                                 request->method, &req, &allow);
+    if (!IS_ERR_OR_NULL(handler)) {
+        req.body = request->body;
+        req.body_len = request->body_len;
+        req.keep_alive = keep_alive;
+        req.conn = conn;
+        ret = handler->handle(&req, handler->data);
+        if (!ret && !request->responded)
+            pr_warn_ratelimited("handler for %s returned without responding\n",
+                                handler->prefix);
+        http_router_put(handler);
+        /* Whatever it returned, a handler that didn't answer failed */
+        if (!request->responded) {
+            vec[0].iov_base = HTTP_RESPONSE_500;
+            vec[0].iov_len = sizeof(HTTP_RESPONSE_500) - 1;
+            http_conn_queue_response(conn, vec, 1, NULL, 0, NULL, NULL);
+            http_stats_error(request->route);
+            set_bit(HTTP_CONN_CLOSING, &conn->flags);
+        }
+        goto out;
+    }
+    if (IS_ERR(handler)) {
+        http_server_not_allowed(conn, allow, keep_alive);
+        goto out;
+    }
+
+    if (request->method != HTTP_GET) {
+        vec[0].iov_base =
+            keep_alive ? HTTP_RESPONSE_501_KEEPALIVE : HTTP_RESPONSE_501;
+        vec[0].iov_len = strlen(vec[0].iov_base);
+        http_conn_queue_response(conn, vec, 1, NULL, 0, NULL, NULL);
+        http_stats_error(request->route);
+        goto out;
+    }
+
+    if (http_file_enabled() || http_proxy_enabled()) {
+        /* Static files first, whatever they lack goes upstream */
+        request->route = HTTP_ROUTE_FILE;
+        if (http_file_enabled())
+            file = http_server_lookup_file(request);
+        if (http_proxy_enabled() &&
+            (!file || (IS_ERR(file) && PTR_ERR(file) == -ENOENT))) {
+            request->route = HTTP_ROUTE_PROXY;
+            return http_server_proxy(conn, request, keep_alive);
+        }
+        if (IS_ERR(file) && PTR_ERR(file) != -ENOENT)
+            file = NULL; /* 500 */
+        if (IS_ERR(file)) {
+            vec[0].iov_base =
+                keep_alive ? HTTP_RESPONSE_404_KEEPALIVE : HTTP_RESPONSE_404;
+            vec[0].iov_len = strlen(vec[0].iov_base);
+            http_conn_queue_response(conn, vec, 1, NULL, 0, NULL, NULL);
+            http_stats_error(request->route);
+        } else if (file) {
+            nr = http_server_typed_header(
+                vec, file->content_type, content_length,
+                sizeof(content_length), file->size, keep_alive);
+            http_conn_queue_response(conn, vec, nr, NULL, 0, NULL, file);
+            http_file_put(file);
+        } else {
+            http_conn_queue_text(conn, &text, NULL, NULL);
+        }
+        goto out;
+    }
+
+    rpmsg = (char *) kcalloc(sizeof("Instruction pattern is NOT matched!\n"),
+                             sizeof(char), GFP_KERNEL);
+    if (rpmsg)
+        strncat(rpmsg, "Instruction pattern is NOT matched!\n",
+                sizeof("Instruction pattern is NOT matched!"));
+    http_conn_queue_text(conn, &text, NULL, rpmsg);
+
+out:
+    http_stats_request(request->route);
+    trace_khttpd_route(conn->socket, request->route);
+    return 0;
+}
+
+static void http_conn_set_timer(struct http_conn *conn,
+                                enum http_conn_timer state)
+{
+    const struct http_server_config *config;
+    unsigned long timeout = 0;
+
+    if (conn->timer_state == state)
+        return;
+    conn->timer_state = state;
+    rcu_read_lock();
+    config = rcu_dereference(pool.config);
+    if (state == HTTP_TIMER_HEADER)
+        timeout = config->header_timeout;
+    else if (state == HTTP_TIMER_IDLE)
+        timeout = config->idle_timeout;
+    rcu_read_unlock();
+    /* Idle clients stay evictable even when they may idle forever */
+    http_timer_arm(&conn->timer, timeout, state == HTTP_TIMER_IDLE);
+}
+
+/* Timer expiry or eviction: shut the socket down, the owner then closes */
+static void http_conn_timeout(struct http_timer *timer)
+{
+    struct http_conn *conn = container_of(timer, struct http_conn, timer);
+    kernel_sock_shutdown(conn->socket, SHUT_RDWR);
+}
+
+static int http_parser_callback_message_begin(http_parser *parser)
+{
+    struct http_request *request = parser->data;
+    struct http_conn *conn = container_of(request, struct http_conn, request);
+
+    kvfree(request->body);
+    memset(request, 0x00, sizeof(struct http_request));
+    request->n = -1;
+    request->start = ktime_get_ns();
+    trace_khttpd_parse_start(conn->socket);
+    /* The first request of a connection also waited in the accept queue */
+    request->origin = conn->accepted ?: request->start;
+    conn->accepted = 0;
+    /* Not extended by later bytes, so trickled headers still time out */
+    http_conn_set_timer(conn, HTTP_TIMER_HEADER);
+    return 0;
+}
+
+/*
+ * The callbacks may see a URL, name or value split over several receives;
+ * the pieces are contiguous since the request is kept in one buffer.
+ */
+static void http_slice_extend(struct http_slice *slice,
+                              const char *p,
+                              size_t len)
+{
+    if (!slice->p)
+        slice->p = p;
+    slice->len = p + len - slice->p;
+}
+
+static int http_parser_callback_request_url(http_parser *parser,
+                                            const char *p,
+                                            size_t len)
+{
+    struct http_request *request = parser->data;
+
+    http_slice_extend(&request->url, p, len);
+    request->head_end = p + len;
+    return 0;
+}
+
+static int http_parser_callback_header_field(http_parser *parser,
+                                             const char *p,
+                                             size_t len)
+{
+    struct http_request *request = parser->data;
+
+    if (request->header_value) {
+        request->header_value = false;
+        request->header_field.p = NULL;
+    }
+    http_slice_extend(&request->header_field, p, len);
+    request->head_end = p + len;
+    return 0;
+}
+
+static bool http_header_is(const struct http_request *request,
+                           const char *name)
+{
+    return request->header_field.len == strlen(name) &&
+           !strncasecmp(request->header_field.p, name, strlen(name));
+}
+
+/* Repeated headers are kept as a list of values, @first starts a new one */
+static void http_header_append(struct http_header *header,
+                               bool first,
+                               const char *p,
+                               size_t len)
+{
+    if (header->overflow)
+        return;
+    if (first && header->nr == HEADER_VALUES) {
+        header->overflow = true;
+        return;
+    }
+    if (first)
+        header->nr++;
+    http_slice_extend(&header->values[header->nr - 1], p, len);
+}
+
+static int http_parser_callback_header_value(http_parser *parser,
+                                             const char *p,
+                                             size_t len)
+{
+    struct http_request *request = parser->data;
+    bool first = !request->header_value;
+
+    request->header_value = true;
+    request->head_end = p + len;
+    if (http_header_is(request, "If-None-Match"))
+        http_header_append(&request->if_none_match, first, p, len);
+    else if (http_header_is(request, "Accept-Encoding"))
+        http_header_append(&request->accept_encoding, first, p, len);
+    return 0;
+}
+
+/* Answer 413 and stop parsing, what is left of the body is never read */
+static int http_request_too_large(struct http_request *request)
+{
+    struct http_conn *conn = container_of(request, struct http_conn, request);
+    struct kvec vec = {.iov_base = HTTP_RESPONSE_413,
+                       .iov_len = sizeof(HTTP_RESPONSE_413) - 1};
+
+    http_conn_queue_response(conn, &vec, 1, NULL, 0, NULL, NULL);
+    set_bit(HTTP_CONN_CLOSING, &conn->flags);
+    return -1;
+}
+
+static int http_parser_callback_headers_complete(http_parser *parser)
+{
+    struct http_request *request = parser->data;
+    request->method = parser->method;
+    request->headers_complete = true;
+    /* Announced too large: refused before any of it is buffered */
+    if (!(parser->flags & F_CHUNKED) &&
+        parser->content_length != ULLONG_MAX &&
+        parser->content_length > BODY_MAX_SIZE)
+        return http_request_too_large(request);
+    return 0;
+}
+
+/* Bodies are copied out, the receive buffer they come in is reused */
+static int http_parser_callback_body(http_parser *parser,
+                                     const char *p,
+                                     size_t len)
+{
+    struct http_request *request = parser->data;
+    struct http_conn *conn = container_of(request, struct http_conn, request);
+    size_t need = request->body_len + len, size;
+    char *body;
+
+    /* Chunked bodies have no length to check up front */
+    if (need > BODY_MAX_SIZE)
+        return http_request_too_large(request);
+    if (need > request->body_size) {
+        size = min_t(size_t, roundup_pow_of_two(need), BODY_MAX_SIZE);
+        body = kvmalloc(size, GFP_KERNEL);
+        if (!body) {
+            set_bit(HTTP_CONN_CLOSING, &conn->flags);
+            return -1;
+        }
+        if (request->body_len)
+            memcpy(body, request->body, request->body_len);
+        kvfree(request->body);
+        request->body = body;
+        request->body_size = size;
+    }
+    memcpy(request->body + request->body_len, p, len);
+    request->body_len = need;
+    return 0;
+}
+
+static int http_parser_callback_message_complete(http_parser *parser)
+{
+    struct http_request *request = parser->data;
+    struct http_conn *conn = container_of(request, struct http_conn, request);
+    int keep_alive = http_should_keep_alive(parser);
+    u64 parsed = ktime_get_ns();
+
+    trace_khttpd_parse_complete(conn->socket,
+                                http_method_str(parser->method),
+                                request->url.p, request->url.len, keep_alive);
+    http_conn_set_timer(conn, HTTP_TIMER_NONE);
+    http_server_response(request, keep_alive);
+    http_stats_record(request->route, HTTP_STAGE_PARSE,
+                      parsed - request->start);
+    request->complete = 1;
+    kvfree(request->body);
+    request->body = NULL;
+    /* Leave pipelined requests behind a non keep-alive one unparsed */
+    if (!keep_alive)
+        http_parser_pause(parser, 1);
+    return 0;
+}
+
+static const struct http_parser_settings parser_settings = {
+    .on_message_begin = http_parser_callback_message_begin,
+    .on_url = http_parser_callback_request_url,
+    .on_header_field = http_parser_callback_header_field,
+    .on_header_value = http_parser_callback_header_value,
+    .on_headers_complete = http_parser_callback_headers_complete,
+    .on_body = http_parser_callback_body,
+    .on_message_complete = http_parser_callback_message_complete};
+
+/* The connection takes over the reference to the client of @accepted */
+static void http_conn_init(struct http_conn *conn,
+                           const struct http_accepted *accepted)
+{
+    struct socket *socket = accepted->socket;
+    struct sockaddr_in peer;
+
+    memset(conn, 0, sizeof(*conn));
+    kref_init(&conn->ref);
+    conn->socket = socket;
+    conn->accepted = accepted->time;
+    conn->client = accepted->client;
+    if (http_log_enabled() &&
+        kernel_getpeername(socket, (struct sockaddr *) &peer) >= 0)
+        conn->log.addr = peer.sin_addr.s_addr;
+    http_parser_init(&conn->parser, HTTP_REQUEST);
+    conn->parser.data = &conn->request;
+    INIT_LIST_HEAD(&conn->out);
+    init_waitqueue_head(&conn->wait);
+    http_timer_init(&conn->timer, http_conn_timeout);
+    /* The first request is due within the header timeout */
+    http_conn_set_timer(conn, HTTP_TIMER_HEADER);
+}
+
+/* Between requests the connection idles, also while output drains */
+static void http_conn_parsed(struct http_conn *conn)
+{
+    if (conn->request.complete)
+        http_conn_set_timer(conn, HTTP_TIMER_IDLE);
+}
+
+/* Point the slices of @request into [@from, @from + @len) at @to instead */
+static void http_request_move(struct http_request *request,
+                              const char *from,
+                              size_t len,
+                              const char *to)
+{
+    struct http_slice *slices[2 + 2 * HEADER_VALUES];
+    unsigned int i, nr = 0;
+
+    slices[nr++] = &request->url;
+    slices[nr++] = &request->header_field;
+    for (i = 0; i < request->if_none_match.nr; i++)
+        slices[nr++] = &request->if_none_match.values[i];
+    for (i = 0; i < request->accept_encoding.nr; i++)
+        slices[nr++] = &request->accept_encoding.values[i];
+    for (i = 0; i < nr; i++)
+        if (slices[i]->p >= from && slices[i]->p <= from + len)
+            slices[i]->p = to + (slices[i]->p - from);
+    request->head_end = to + (request->head_end - from);
+}
+
+/*
+ * Keep the request in progress across receives: from its URL on, what was
+ * received moves to the front of the connection's own buffer, where the
+ * next receive appends. Its head must fit, the rest of a request with a
+ * body is not referenced and isn't kept.
+ */
+static int http_conn_carry(struct http_conn *conn,
+                           const char *data,
+                           size_t len)
+{
+    struct http_request *request = &conn->request;
+    const char *start = request->url.p, *end = data + len;
+    size_t keep;
+
+    if (!start || request->complete) {
+        if (conn->buf)
+            kmem_cache_free(http_buf_cachep, conn->buf);
+        conn->buf = NULL;
+        conn->buf_len = 0;
+        return 0;
+    }
+    if (request->headers_complete)
+        end = request->head_end;
+    keep = end - start;
+    if (!request->headers_complete && keep >= RECV_BUFFER_SIZE - 1)
+        return -E2BIG;
+
+    if (!conn->buf) {
+        conn->buf = kmem_cache_alloc(http_buf_cachep, GFP_KERNEL);
+        if (!conn->buf)
+            return -ENOMEM;
+    }
+    if (start != conn->buf) {
+        memmove(conn->buf, start, keep);
+        http_request_move(request, start, keep, conn->buf);
+    }
+    conn->buf_len = keep;
+    return 0;
+}
+
+/*
+ * Receive into @buf and parse, or behind the head of the request in
+ * progress if it was kept. Returns what http_server_recv() does.
+ */
+static int http_conn_receive(struct http_conn *conn, char *buf, int flags)
+{
+    size_t size = RECV_BUFFER_SIZE - 1;
+    struct kvec vec;
+    int ret, err;
+
+    if (conn->buf && !conn->request.headers_complete) {
+        buf = conn->buf + conn->buf_len;
+        size -= conn->buf_len;
+    }
+    ret = http_server_recv(conn->socket, buf, size, flags);
+    if (ret <= 0)
+        return ret;
+    http_parser_execute(&conn->parser, &parser_settings, buf, ret);
+
+    err = http_conn_carry(conn, buf, ret);
+    if (err == -E2BIG) {
+        vec.iov_base = HTTP_RESPONSE_431;
+        vec.iov_len = sizeof(HTTP_RESPONSE_431) - 1;
+        http_conn_queue_response(conn, &vec, 1, NULL, 0, NULL, NULL);
+    }
+    if (err)
+        set_bit(HTTP_CONN_CLOSING, &conn->flags);
+    return ret;
+}
+
+/* Close @socket, @counted if it still holds a slot of max_connections */
+static void __http_server_release(struct socket *socket, bool counted)
+{
+    trace_khttpd_close(socket);
+    kernel_sock_shutdown(socket, SHUT_RDWR);
+    sock_release(socket);
+    if (counted)
+        atomic_dec(&pool.nr_connections);
+    http_stats_count(HTTP_STAT_CLOSED);
+}
+
+/* Once its timer is deleted: an evicted connection gave its slot away */
+static void http_conn_release_socket(struct http_conn *conn)
+{
+    __http_server_release(conn->socket, !conn->timer.evicted);
+}
+
+/*
+ * Enforce max_connections, evicting the longest idle keep-alive client. The
+ * slot of the evicted connection goes to the new one, so the count stays at
+ * the cap while the evicted one closes.
+ */
+static bool http_server_admit(void)
+{
+    unsigned int max;
+
+    rcu_read_lock();
+    max = rcu_dereference(pool.config)->max_connections;
+    rcu_read_unlock();
+    if (max && atomic_read(&pool.nr_connections) >= max)
+        return http_timer_evict_idle();
+    atomic_inc(&pool.nr_connections);
+    return true;
+}
+
+#ifdef __KERNEL__
+static void http_server_release(struct socket *socket)
+{
+    __http_server_release(socket, true);
+}
+
+/* A connection accepted but never served */
+static void http_accepted_release(const struct http_accepted *accepted)
+{
+    http_limit_put(accepted->client);
+    http_server_release(accepted->socket);
+}
+
+/* Can the response of @job, or the start of a streamed one, be sent? */
+static bool http_job_ready(struct http_job *job)
+{
+    return smp_load_acquire(&job->done) ||
+           (job->batch && !list_empty_careful(&job->items));
+}
+
+/* Is the oldest response still being computed? */
+static bool http_conn_computing(struct http_conn *conn)
+{
+    struct http_out *out;
+
+    if (list_empty(&conn->out))
+        return false;
+    out = list_first_entry(&conn->out, struct http_out, list);
+    return out->job && !http_job_ready(out->job);
+}
+
+/* Blocking mode: send everything queued, waiting for computations in turn */
+static int http_conn_drain(struct http_conn *conn)
+{
+    int ret;
+
+    while ((ret = http_conn_flush(conn, 0)) >= 0 && !list_empty(&conn->out))
+        if (wait_event_interruptible(conn->wait, !http_conn_computing(conn)))
+            return -EINTR;
+    return ret;
+}
+
+/*
+ * Shed a connection that waited, or would wait, too long for a worker: one
+ * non-blocking send of a static 503, then the owner releases the socket.
+ */
+static void http_server_reject(struct socket *socket)
+{
+    struct kvec vec = {.iov_base = HTTP_RESPONSE_503,
+                       .iov_len = sizeof(HTTP_RESPONSE_503) - 1};
+    struct msghdr msg = {.msg_flags = MSG_DONTWAIT};
+
+    kernel_sendmsg(socket, &msg, &vec, 1, vec.iov_len);
+    http_stats_count(HTTP_STAT_DROPPED);
+}
+
+/* Same for a client over its rate limit, before it is even queued */
+static void http_server_throttle(struct socket *socket)
+{
+    struct kvec vec = {.iov_base = HTTP_RESPONSE_429,
+                       .iov_len = sizeof(HTTP_RESPONSE_429) - 1};
+    struct msghdr msg = {.msg_flags = MSG_DONTWAIT};
+
+    kernel_sendmsg(socket, &msg, &vec, 1, vec.iov_len);
+    http_stats_count(HTTP_STAT_THROTTLED);
+}
+
+/* Has a connection accepted at @accepted waited longer than allowed? */
+static bool http_server_overdue(u64 accepted)
+{
+    u64 delay;
+
+    rcu_read_lock();
+    delay = rcu_dereference(pool.config)->queue_delay;
+    rcu_read_unlock();
+    return delay && ktime_get_ns() - accepted > delay;
+}
+
+static void http_server_connection(const struct http_accepted *accepted)
+{
+    char *buf;
+    struct http_conn *conn;
+
+    conn = kmem_cache_alloc(http_conn_cachep, GFP_KERNEL);
+    buf = kmem_cache_alloc(http_buf_cachep, GFP_KERNEL);
+    if (!conn || !buf) {
+        pr_err("can't allocate memory!\n");
+        goto out;
+    }
+
+    http_conn_init(conn, accepted);
+    /* Blocking receiving */
+    while (!kthread_should_stop()) {
+        int ret = http_conn_receive(conn, buf, 0);
+        if (ret <= 0) {
+            if (ret)
+                pr_err("recv error: %d\n", ret);
+            break;
+        }
+        http_conn_parsed(conn);
+        if (http_conn_drain(conn) < 0 ||
+            test_bit(HTTP_CONN_CLOSING, &conn->flags) ||
+            (conn->request.complete && !http_should_keep_alive(&conn->parser)))
+            break;
+    }
+    http_timer_del(&conn->timer);
+    kmem_cache_free(http_buf_cachep, buf);
+    http_conn_release_socket(conn);
+    /* Computations still running for it hold on to the rest */
+    http_conn_put(conn);
+    return;
+
+out:
+    if (buf)
+        kmem_cache_free(http_buf_cachep, buf);
+    if (conn)
+        kmem_cache_free(http_conn_cachep, conn);
+    http_accepted_release(accepted);
+}
+
+/* Past the pool size since it was lowered, not to take connections */
+static bool http_worker_parked(struct http_worker *worker)
+{
+    unsigned int i = worker - pool.workers;
+    bool parked;
+
+    rcu_read_lock();
+    parked = i >= rcu_dereference(pool.config)->nr_workers;
+    rcu_read_unlock();
+    return parked;
+}
+
+/* Pool worker: take accepted sockets off the queue and serve them */
+static int http_server_worker(void *arg)
+{
+    struct http_worker *worker = arg;
+    struct http_accepted accepted;
+
+    allow_signal(SIGKILL);
+    allow_signal(SIGTERM);
+
+    while (!kthread_should_stop()) {
+        if (http_worker_parked(worker)) {
+            wait_event_interruptible(pool.park,
+                                     !http_worker_parked(worker) ||
+                                         kthread_should_stop());
+            continue;
+        }
+        /* Interrupted by the unload signal, re-check kthread_should_stop() */
+        if (wait_event_interruptible_exclusive(
+                pool.wait,
+                !kfifo_is_empty(&pool.queue) || kthread_should_stop()))
+            continue;
+
+        if (!kfifo_out_spinlocked(&pool.queue, &accepted, 1, &pool.lock))
+            continue;
+        atomic_dec(&pool.nr_queued);
+
+        if (http_server_overdue(accepted.time)) {
+            http_server_reject(accepted.socket);
+            http_accepted_release(&accepted);
+            continue;
+        }
+        http_server_connection(&accepted);
+    }
+    return 0;
+}
+
+static void http_conn_schedule(struct http_conn *conn)
+{
+    struct http_worker *worker = conn->worker;
+
+    if (test_and_set_bit(HTTP_CONN_QUEUED, &conn->flags))
+        return;
+    spin_lock_bh(&worker->lock);
+    list_add_tail(&conn->node, &worker->ready);
+    spin_unlock_bh(&worker->lock);
+    wake_up(&worker->wait);
+}
+
+/* Socket callbacks, called from softirq context */
+static void http_conn_data_ready(struct sock *sk)
+{
+    struct http_conn *conn;
+
+    read_lock_bh(&sk->sk_callback_lock);
+    conn = sk->sk_user_data;
+    if (conn)
+        http_conn_schedule(conn);
+    read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void http_conn_write_space(struct sock *sk)
+{
+    struct http_conn *conn;
+
+    read_lock_bh(&sk->sk_callback_lock);
+    conn = sk->sk_user_data;
+    if (conn) {
+        conn->saved_write_space(sk);
+        if (sk_stream_is_writeable(sk))
+            http_conn_schedule(conn);
+    }
+    read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void http_conn_state_change(struct sock *sk)
+{
+    struct http_conn *conn;
+
+    read_lock_bh(&sk->sk_callback_lock);
+    conn = sk->sk_user_data;
+    if (conn)
+        http_conn_schedule(conn);
+    read_unlock_bh(&sk->sk_callback_lock);
+}
+
+/* Prefer a worker running on @cpu, then on its node, round-robin otherwise */
+static struct http_worker *http_pool_pick_worker(int cpu)
+{
+    unsigned int i, nr, start = atomic_inc_return(&pool.next_worker);
+    struct http_worker *local = NULL;
+
+    /* Parked workers keep their connections, but get no new one */
+    rcu_read_lock();
+    nr = rcu_dereference(pool.config)->nr_workers;
+    rcu_read_unlock();
+    for (i = 0; cpu >= 0 && i < nr; i++) {
+        struct http_worker *worker = &pool.workers[(start + i) % nr];
+        if (worker->cpu == cpu)
+            return worker;
+        if (!local && cpu_to_node(worker->cpu) == cpu_to_node(cpu))
+            local = worker;
+    }
+    return local ? local : &pool.workers[start % nr];
+}
+
+/*
+ * Hand a connection to the worker on the CPU its packets arrive on, so the
+ * socket, the connection state and the worker share caches and NUMA node.
+ * The listener's CPU stands in until the socket has received anything.
+ */
+static int http_conn_attach(const struct http_accepted *accepted, int cpu)
+{
+    struct sock *sk = accepted->socket->sk;
+    int rx_cpu = READ_ONCE(sk->sk_incoming_cpu);
+    struct http_worker *worker;
+    struct http_conn *conn;
+
+    if (rx_cpu >= 0 && rx_cpu < nr_cpu_ids)
+        cpu = rx_cpu;
+    worker = http_pool_pick_worker(cpu);
+    conn = kmem_cache_alloc_node(http_conn_cachep, GFP_KERNEL,
+                                 cpu_to_node(worker->cpu));
+    if (!conn)
+        return -ENOMEM;
+    http_conn_init(conn, accepted);
+    set_bit(HTTP_CONN_NEW, &conn->flags);
+    conn->worker = worker;
+
+    spin_lock_bh(&worker->lock);
+    list_add_tail(&conn->link, &worker->conns);
+    spin_unlock_bh(&worker->lock);
+
+    write_lock_bh(&sk->sk_callback_lock);
+    conn->saved_data_ready = sk->sk_data_ready;
+    conn->saved_write_space = sk->sk_write_space;
+    conn->saved_state_change = sk->sk_state_change;
+    sk->sk_user_data = conn;
+    sk->sk_data_ready = http_conn_data_ready;
+    sk->sk_write_space = http_conn_write_space;
+    sk->sk_state_change = http_conn_state_change;
+    write_unlock_bh(&sk->sk_callback_lock);
+
+    /* The request may have arrived before the callbacks were installed */
+    http_conn_schedule(conn);
+    return 0;
+}
+
+static void http_conn_close(struct http_conn *conn)
+{
+    struct http_worker *worker = conn->worker;
+    struct sock *sk = conn->socket->sk;
+
+    write_lock_bh(&sk->sk_callback_lock);
+    sk->sk_user_data = NULL;
+    sk->sk_data_ready = conn->saved_data_ready;
+    sk->sk_write_space = conn->saved_write_space;
+    sk->sk_state_change = conn->saved_state_change;
+    write_unlock_bh(&sk->sk_callback_lock);
+
+    /* No callback nor computation can queue the connection any more */
+    spin_lock_bh(&worker->lock);
+    set_bit(HTTP_CONN_CLOSED, &conn->flags);
+    if (test_bit(HTTP_CONN_QUEUED, &conn->flags))
+        list_del(&conn->node);
+    list_del(&conn->link);
+    spin_unlock_bh(&worker->lock);
+
+    if (test_and_clear_bit(HTTP_CONN_NEW, &conn->flags))
+        atomic_dec(&pool.nr_queued);
+    http_timer_del(&conn->timer);
+    http_conn_release_socket(conn);
+    http_conn_put(conn);
+}
+
+/* Drain whatever the socket has without blocking, then go back to sleep */
+static void http_conn_process(struct http_conn *conn, char *buf)
+{
+    int ret;
+
+    /* Reached by its worker for the first time, unless too late */
+    if (test_and_clear_bit(HTTP_CONN_NEW, &conn->flags)) {
+        atomic_dec(&pool.nr_queued);
+        if (http_server_overdue(conn->accepted)) {
+            http_server_reject(conn->socket);
+            http_conn_close(conn);
+            return;
+        }
+    }
+
+    ret = http_conn_flush(conn, MSG_DONTWAIT);
+
+    while (ret >= 0 && list_empty(&conn->out)) {
+        if (test_bit(HTTP_CONN_CLOSING, &conn->flags))
+            break;
+        ret = http_conn_receive(conn, buf, MSG_DONTWAIT);
+        if (ret == -EAGAIN)
+            return;
+        if (ret <= 0) {
+            if (ret)
+                pr_err("recv error: %d\n", ret);
+            break;
+        }
+        if (HTTP_PARSER_ERRNO(&conn->parser) != HPE_OK ||
+            (conn->request.complete && !http_should_keep_alive(&conn->parser)))
+            set_bit(HTTP_CONN_CLOSING, &conn->flags);
+        http_conn_parsed(conn);
+        ret = http_conn_flush(conn, MSG_DONTWAIT);
+    }
+
+    /* Wait for sk_write_space before closing on pending output */
+    if (ret >= 0 && !list_empty(&conn->out))
+        return;
+    http_conn_close(conn);
+}
+
+/* Event-driven worker: serve the connections whose sockets signalled it */
+static int http_event_worker(void *arg)
+{
+    struct http_worker *worker = arg;
+    struct http_conn *conn;
+    LIST_HEAD(ready);
+
+    allow_signal(SIGKILL);
+    allow_signal(SIGTERM);
+
+    while (!kthread_should_stop()) {
+        if (wait_event_interruptible(worker->wait,
+                                     !list_empty_careful(&worker->ready) ||
+                                         kthread_should_stop()))
+            continue;
+
+        spin_lock_bh(&worker->lock);
+        list_splice_init(&worker->ready, &ready);
+        spin_unlock_bh(&worker->lock);
+
+        while (!list_empty(&ready)) {
+            conn = list_first_entry(&ready, struct http_conn, node);
+            list_del_init(&conn->node);
+            clear_bit(HTTP_CONN_QUEUED, &conn->flags);
+            http_conn_process(conn, worker->buf);
+        }
+    }
+    return 0;
+}
+#endif
+
+int http_server_register_builtins(void)
+{
+    size_t i;
+    int err;
+
+    for (i = 0; i < ARRAY_SIZE(http_builtin_handlers); i++) {
+        err = http_register_handler(&http_builtin_handlers[i]);
+        if (err) {
+            while (i--)
+                http_unregister_handler(&http_builtin_handlers[i]);
+            return err;
+        }
+    }
+    return 0;
+}
+
+void http_server_unregister_builtins(void)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(http_builtin_handlers); i++)
+        http_unregister_handler(&http_builtin_handlers[i]);
+}
+
+static struct http_server_config *http_server_config_alloc(
+    const struct http_server_param *param)
+{
+    struct http_server_config *config = kmalloc(sizeof(*config), GFP_KERNEL);
+
+    if (!config)
+        return NULL;
+    config->nr_workers = param->nr_workers;
+    config->idle_timeout = param->idle_timeout * HZ;
+    config->header_timeout = param->header_timeout * HZ;
+    config->max_connections = param->max_connections;
+    config->queue_delay = (u64) param->queue_delay * NSEC_PER_MSEC;
+    config->batch_max = param->batch_max;
+    config->batch_cost = param->batch_cost;
+    return config;
+}
+
+/* What both builds share: the settings, slab caches and compute workqueue */
+static int http_server_init(struct http_server_param *param)
+{
+    struct http_server_config *config = http_server_config_alloc(param);
+
+    if (!config)
+        return -ENOMEM;
+    rcu_assign_pointer(pool.config, config);
+    pool.event_driven = param->event_driven;
+    pool.queue_depth = param->queue_depth;
+    atomic_set(&pool.nr_connections, 0);
+    atomic_set(&pool.nr_queued, 0);
+    atomic_set(&pool.next_worker, 0);
+    http_conn_cachep = kmem_cache_create(KBUILD_MODNAME "_conn",
+                                         sizeof(struct http_conn), 0,
+                                         SLAB_HWCACHE_ALIGN, NULL);
+    http_buf_cachep = kmem_cache_create(KBUILD_MODNAME "_recv_buf",
+                                        RECV_BUFFER_SIZE, 0,
+                                        SLAB_HWCACHE_ALIGN, NULL);
+    if (!http_conn_cachep || !http_buf_cachep) {
+        pr_err("can't create slab caches\n");
+        goto bail_cache;
+    }
+    /*
+     * Unbound, long computations are spread by the scheduler; its CPUs can
+     * be restricted under /sys/devices/virtual/workqueue.
+     */
+    http_compute_wq =
+        alloc_workqueue(KBUILD_MODNAME "_compute", WQ_UNBOUND | WQ_SYSFS, 0);
+    if (!http_compute_wq) {
+        pr_err("can't create compute workqueue\n");
+        goto bail_cache;
+    }
+    return 0;
+
+bail_cache:
+    kmem_cache_destroy(http_buf_cachep);
+    kmem_cache_destroy(http_conn_cachep);
+    rcu_assign_pointer(pool.config, NULL);
+    kfree(config);
+    return -ENOMEM;
+}
+
+/* Computations left drop the last references to their connections */
+static void http_server_exit(void)
+{
+    destroy_workqueue(http_compute_wq);
+    kmem_cache_destroy(http_buf_cachep);
+    kmem_cache_destroy(http_conn_cachep);
+    kfree(rcu_dereference_protected(pool.config, 1));
+    rcu_assign_pointer(pool.config, NULL);
+}
+
+#ifdef __KERNEL__
+static DEFINE_MUTEX(config_lock);
+
+/* Start worker pool.nr_workers on the next allowed CPU, round-robin */
+static int http_worker_start(void)
+{
+    unsigned int i = pool.nr_workers;
+    struct http_worker *worker = &pool.workers[i];
+    int cpu = cpumask_next(pool.last_cpu, pool.cpus);
+
+    if (cpu >= nr_cpu_ids)
+        cpu = cpumask_first(pool.cpus);
+
+    worker->cpu = cpu;
+    spin_lock_init(&worker->lock);
+    INIT_LIST_HEAD(&worker->ready);
+    INIT_LIST_HEAD(&worker->conns);
+    init_waitqueue_head(&worker->wait);
+    if (pool.event_driven) {
+        worker->buf = kmem_cache_alloc_node(http_buf_cachep, GFP_KERNEL,
+                                            cpu_to_node(cpu));
+        worker->task =
+            worker->buf ? kthread_create_on_node(http_event_worker, worker,
+                                                 cpu_to_node(cpu),
+                                                 KBUILD_MODNAME "/%u", i)
+                        : ERR_PTR(-ENOMEM);
+    } else {
+        worker->task = kthread_create_on_node(http_server_worker, worker,
+                                              cpu_to_node(cpu),
+                                              KBUILD_MODNAME "/%u", i);
+    }
+    if (IS_ERR(worker->task)) {
+        pr_err("can't create worker %u\n", i);
+        if (worker->buf)
+            kmem_cache_free(http_buf_cachep, worker->buf);
+        worker->buf = NULL;
+        return PTR_ERR(worker->task);
+    }
+    pool.last_cpu = cpu;
+    pool.nr_workers++;
+    if (pool.bind_workers)
+        kthread_bind(worker->task, cpu);
+    wake_up_process(worker->task);
+    return 0;
+}
+
+int http_server_pool_start(struct http_server_param *param)
+{
+    int err;
+
+    err = http_server_init(param);
+    if (err)
+        return err;
+    err = kfifo_alloc(&pool.queue, pool.queue_depth, GFP_KERNEL);
+    if (err) {
+        pr_err("can't allocate worker queue\n");
+        goto bail;
+    }
+    spin_lock_init(&pool.lock);
+    init_waitqueue_head(&pool.wait);
+    init_waitqueue_head(&pool.park);
+
+    /* Room for the pool to grow into, so workers never move */
+    pool.max_workers = max(param->nr_workers,
+                           WORKERS_PER_CPU_MAX * cpumask_weight(param->cpus));
+    pool.workers =
+        kcalloc(pool.max_workers, sizeof(struct http_worker), GFP_KERNEL);
+    if (!pool.workers) {
+        pr_err("can't allocate worker pool\n");
+        kfifo_free(&pool.queue);
+        err = -ENOMEM;
+        goto bail;
+    }
+    pool.cpus = param->cpus;
+    pool.last_cpu = -1;
+    pool.bind_workers = param->bind_workers;
+
+    while (pool.nr_workers < param->nr_workers) {
+        err = http_worker_start();
+        if (err) {
+            http_server_pool_stop();
+            return err;
+        }
+    }
+    return 0;
+
+bail:
+    http_server_exit();
+    return err;
+}
+
+int http_server_reconfigure(struct http_server_param *param)
+{
+    struct http_server_config *config, *old;
+    int err = 0;
+
+    if (!param->nr_workers || param->nr_workers > pool.max_workers)
+        return -EINVAL;
+    config = http_server_config_alloc(param);
+    if (!config)
+        return -ENOMEM;
+
+    mutex_lock(&config_lock);
+    /* Started ones wait, parked or idle, until the new size is published */
+    while (!err && pool.nr_workers < config->nr_workers)
+        err = http_worker_start();
+    if (err) {
+        mutex_unlock(&config_lock);
+        kfree(config);
+        return err;
+    }
+    old = rcu_dereference_protected(pool.config,
+                                    lockdep_is_held(&config_lock));
+    rcu_assign_pointer(pool.config, config);
+    wake_up_all(&pool.park);
+    synchronize_rcu();
+    kfree(old);
+    mutex_unlock(&config_lock);
+    return 0;
+}
+
+void http_server_pool_stop(void)
+{
+    struct http_conn *conn, *tmp;
+    struct http_accepted accepted;
+    unsigned int i;
+
+    /* Parked workers too, they may still hold connections */
+    for (i = 0; i < pool.nr_workers; i++) {
+        send_sig(SIGTERM, pool.workers[i].task, 1);
+        kthread_stop(pool.workers[i].task);
+    }
+    /* Workers are gone, tear down the connections they were watching */
+    for (i = 0; i < pool.nr_workers; i++) {
+        struct http_worker *worker = &pool.workers[i];
+        list_for_each_entry_safe (conn, tmp, &worker->conns, link)
+            http_conn_close(conn);
+    }
+    for (i = 0; i < pool.nr_workers; i++)
+        if (pool.workers[i].buf)
+            kmem_cache_free(http_buf_cachep, pool.workers[i].buf);
+
+    /* Release connections that were accepted but never picked up */
+    while (kfifo_out(&pool.queue, &accepted, 1))
+        http_accepted_release(&accepted);
+    kfifo_free(&pool.queue);
+    /* Computations wake their workers until the workqueue is drained */
+    http_server_exit();
+    pool.nr_workers = 0;
+    kfree(pool.workers);
+    pool.workers = NULL;
+}
+
+int http_server_daemon(void *arg)
+{
+    struct http_accepted accepted;
+    struct socket *socket;
+    struct http_listener *listener = (struct http_listener *) arg;
+
+    allow_signal(SIGKILL);
+    allow_signal(SIGTERM);
+
+    while (!kthread_should_stop()) {
+        // Accept connection via kernel socket API
+        int err = kernel_accept(listener->socket, &socket, 0);
+        if (err < 0) {
+            if (signal_pending(current))
+                break;
+            pr_err("kernel_accept() error: %d\n", err);
+            continue;
+        }
+        if (!http_server_admit()) {
+            kernel_sock_shutdown(socket, SHUT_RDWR);
+            sock_release(socket);
+            http_stats_count(HTTP_STAT_REFUSED);
+            continue;
+        }
+        http_stats_count(HTTP_STAT_ACCEPTED);
+        trace_khttpd_accept(socket, listener->cpu);
+        // The connection keeps the rate limit bucket it was admitted by
+        if (!http_limit_accept(socket, &accepted.client)) {
+            http_server_throttle(socket);
+            http_server_release(socket);
+            continue;
+        }
+        accepted.socket = socket;
+        accepted.time = ktime_get_ns();
+        // Never wait for a worker here: with queue_depth connections
+        // already waiting every worker is busy, answer 503 right away
+        if (atomic_inc_return(&pool.nr_queued) > pool.queue_depth) {
+            atomic_dec(&pool.nr_queued);
+            http_server_reject(socket);
+            http_accepted_release(&accepted);
+            continue;
+        }
+        if (pool.event_driven) {
+            err = http_conn_attach(&accepted, listener->cpu);
+            if (err < 0) {
+                pr_err("can't attach connection: %d\n", err);
+                atomic_dec(&pool.nr_queued);
+                http_accepted_release(&accepted);
+            }
+            continue;
+        }
+        // Hand the connection over to the worker pool
+        if (!kfifo_in_spinlocked(&pool.queue, &accepted, 1, &pool.lock)) {
+            atomic_dec(&pool.nr_queued);
+            http_server_reject(socket);
+            http_accepted_release(&accepted);
+            continue;
+        }
+        wake_up_interruptible(&pool.wait);
+    }
+    return 0;
+}
+#else
+int http_user_start(struct http_server_param *param)
+{
+    return http_server_init(param);
+}
+
+void http_user_stop(void)
+{
+    http_server_exit();
+}
+
+char *http_user_buf_alloc(void)
+{
+    return kmem_cache_alloc(http_buf_cachep, GFP_KERNEL);
+}
+
+void http_user_buf_free(char *buf)
+{
+    kmem_cache_free(http_buf_cachep, buf);
+}
+
+struct http_conn *http_user_conn_open(int fd)
+{
+    struct http_accepted accepted;
+    struct http_conn *conn;
+    struct socket *socket;
+
+    if (!http_server_admit()) {
+        http_stats_count(HTTP_STAT_REFUSED);
+        return NULL;
+    }
+    socket = kmalloc(sizeof(*socket), GFP_KERNEL);
+    conn = kmem_cache_alloc(http_conn_cachep, GFP_KERNEL);
+    if (!socket || !conn) {
+        kfree(socket);
+        if (conn)
+            kmem_cache_free(http_conn_cachep, conn);
+        atomic_dec(&pool.nr_connections);
+        return NULL;
+    }
+    socket->fd = fd;
+    http_stats_count(HTTP_STAT_ACCEPTED);
+    accepted.socket = socket;
+    accepted.time = ktime_get_ns();
+    accepted.client = NULL; /* nothing is rate limited in userspace */
+    http_conn_init(conn, &accepted);
+    return conn;
+}
+
+/*
+ * http_conn_process() without a worker: computations run inline when the
+ * request is parsed, so the response is never waited for.
+ */
+int http_user_conn_process(struct http_conn *conn, char *buf)
+{
+    int ret = http_conn_flush(conn, MSG_DONTWAIT);
+
+    while (ret >= 0 && list_empty(&conn->out)) {
+        if (test_bit(HTTP_CONN_CLOSING, &conn->flags))
+            break;
+        ret = http_conn_receive(conn, buf, MSG_DONTWAIT);
+        if (ret == -EAGAIN)
+            return 0;
+        if (ret <= 0) {
+            if (ret)
+                pr_err("recv error: %d\n", ret);
+            break;
+        }
+        if (HTTP_PARSER_ERRNO(&conn->parser) != HPE_OK ||
+            (conn->request.complete && !http_should_keep_alive(&conn->parser)))
+            set_bit(HTTP_CONN_CLOSING, &conn->flags);
+        http_conn_parsed(conn);
+        ret = http_conn_flush(conn, MSG_DONTWAIT);
+    }
+
+    if (ret >= 0 && !list_empty(&conn->out))
+        return 1;
+    return ret < 0 ? ret : -ESHUTDOWN;
+}
+
+void http_user_conn_close(struct http_conn *conn)
+{
+    http_timer_del(&conn->timer);
+    http_conn_release_socket(conn);
+    http_conn_put(conn);
 }
+#endif
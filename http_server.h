@@ -1,12 +1,76 @@
 #ifndef KHTTPD_HTTP_SERVER_H
 #define KHTTPD_HTTP_SERVER_H
 
+#ifdef __KERNEL__
 #include <net/sock.h>
+#else
+#include "compat/user.h"
+#endif
 
+/*
+ * cpus, event_driven, bind_workers and queue_depth are fixed once the pool
+ * started, http_server_reconfigure() applies the rest.
+ */
 struct http_server_param {
-    struct socket *listen_socket;
+    unsigned int nr_workers;
+    const struct cpumask *cpus; /* workers are spread over these CPUs */
+    bool event_driven;
+    bool bind_workers; /* pin each worker to the CPU it was created for */
+    unsigned int idle_timeout;   /* seconds, 0: keep idle clients forever */
+    unsigned int header_timeout; /* seconds to receive a whole request */
+    unsigned int max_connections; /* 0: unlimited */
+    unsigned int queue_depth;     /* connections waiting for a worker */
+    unsigned int queue_delay;     /* ms one may wait, 0: unlimited */
+    unsigned int batch_max;       /* numbers in a POST /fib/batch */
+    unsigned long long batch_cost; /* their sum */
+};
+
+/* A listen socket and the daemon thread accepting on it */
+struct http_listener {
+    struct socket *socket;
+    int cpu; /* CPU the daemon is pinned to, -1 if it floats */
+    struct task_struct *daemon;
 };
 
+/* Route /fib, /fib/batch and /stats, before any request can come in */
+extern int http_server_register_builtins(void);
+extern void http_server_unregister_builtins(void);
+
+#ifdef __KERNEL__
+extern int http_server_pool_start(struct http_server_param *param);
+extern void http_server_pool_stop(void);
+/*
+ * Publish new settings to the running pool, without a lock on the request
+ * path. Lowering nr_workers parks the workers past it: they finish the
+ * connections they hold but take no new ones.
+ */
+extern int http_server_reconfigure(struct http_server_param *param);
 extern int http_server_daemon(void *arg);
+#else
+/*
+ * Userspace build: the event loop of http_user.c owns the sockets and hands
+ * each connection to the request path with these. Only the limits and the
+ * batch settings of @param apply.
+ */
+struct http_conn;
+
+extern int http_user_start(struct http_server_param *param);
+extern void http_user_stop(void);
+
+/* Receive buffer for http_user_conn_process(), one per event loop */
+extern char *http_user_buf_alloc(void);
+extern void http_user_buf_free(char *buf);
+
+/* Serve the accepted non-blocking @fd, NULL leaves it to the caller */
+extern struct http_conn *http_user_conn_open(int fd);
+
+/*
+ * Flush, receive and parse until the socket would block. Returns 0 to wait
+ * for input, 1 to wait for the socket to take the pending output, or an
+ * error once the connection is done with: close it then.
+ */
+extern int http_user_conn_process(struct http_conn *conn, char *buf);
+extern void http_user_conn_close(struct http_conn *conn);
+#endif
 
 #endif
@@ -0,0 +1,309 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+
+#include "http_limit.h"
+#include "http_stats.h"
+#include "http_timer.h"
+
+/*
+ * Log-linear histogram of nanoseconds: every power of two is split into
+ * HIST_SUB linear buckets, so the relative error stays under 25% from the
+ * first nanoseconds up to 2^HIST_EXP_MAX ns (18 minutes). A last bucket of
+ * its own, open-ended, takes everything from there on.
+ */
+#define HIST_SUB_BITS 2
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_EXP_MAX 40
+#define HIST_BUCKETS ((HIST_EXP_MAX - HIST_SUB_BITS + 1) * HIST_SUB + 1)
+
+struct http_histogram {
+    u64 count;
+    u64 sum;
+    u64 buckets[HIST_BUCKETS];
+};
+
+struct http_stats_cpu {
+    u64 counters[HTTP_STAT_MAX];
+    u64 requests[HTTP_ROUTE_MAX];
+    u64 errors[HTTP_ROUTE_MAX];
+    struct http_histogram hist[HTTP_ROUTE_MAX][HTTP_STAGE_MAX];
+};
+
+static const char *const route_names[HTTP_ROUTE_MAX] = {
+    [HTTP_ROUTE_FIB] = "fib",     [HTTP_ROUTE_FILE] = "file",
+    [HTTP_ROUTE_PROXY] = "proxy", [HTTP_ROUTE_STATS] = "stats",
+    [HTTP_ROUTE_OTHER] = "other",
+};
+
+static const char *const stage_names[HTTP_STAGE_MAX] = {
+    [HTTP_STAGE_FIRST_BYTE] = "first_byte",
+    [HTTP_STAGE_PARSE] = "parse",
+    [HTTP_STAGE_COMPUTE] = "compute",
+    [HTTP_STAGE_SEND] = "send",
+};
+
+static const char *const counter_names[HTTP_STAT_MAX] = {
+    [HTTP_STAT_ACCEPTED] = "accepted",
+    [HTTP_STAT_REFUSED] = "refused",
+    [HTTP_STAT_DROPPED] = "dropped",
+    [HTTP_STAT_CLOSED] = "closed",
+    [HTTP_STAT_COMPUTED] = "computed",
+    [HTTP_STAT_COALESCED] = "coalesced",
+    [HTTP_STAT_THROTTLED] = "throttled",
+    [HTTP_STAT_LOG_DROPPED] = "log_dropped",
+};
+
+static struct http_stats_cpu __percpu *stats;
+static struct dentry *stats_dir;
+
+static unsigned int http_stats_bucket(u64 ns)
+{
+    unsigned int exp;
+
+    if (ns < HIST_SUB)
+        return ns;
+    exp = fls64(ns) - 1;
+    if (exp >= HIST_EXP_MAX)
+        return HIST_BUCKETS - 1;
+    return (exp - HIST_SUB_BITS + 1) * HIST_SUB +
+           ((ns >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Largest value falling into bucket @i */
+static u64 http_stats_bucket_max(unsigned int i)
+{
+    unsigned int exp = i / HIST_SUB + HIST_SUB_BITS - 1;
+
+    if (i < HIST_SUB)
+        return i;
+    if (i == HIST_BUCKETS - 1)
+        return U64_MAX;
+    return ((u64)(HIST_SUB + i % HIST_SUB + 1) << (exp - HIST_SUB_BITS)) - 1;
+}
+
+void http_stats_count(enum http_counter counter)
+{
+    if (stats)
+        this_cpu_inc(stats->counters[counter]);
+}
+
+void http_stats_request(enum http_route route)
+{
+    if (stats && route != HTTP_ROUTE_NONE)
+        this_cpu_inc(stats->requests[route]);
+}
+
+void http_stats_error(enum http_route route)
+{
+    if (stats && route != HTTP_ROUTE_NONE)
+        this_cpu_inc(stats->errors[route]);
+}
+
+void http_stats_record(enum http_route route, enum http_stage stage, u64 ns)
+{
+    if (!stats || route == HTTP_ROUTE_NONE)
+        return;
+    this_cpu_inc(stats->hist[route][stage].buckets[http_stats_bucket(ns)]);
+    this_cpu_inc(stats->hist[route][stage].count);
+    this_cpu_add(stats->hist[route][stage].sum, ns);
+}
+
+/* Sum of every CPU, readers may see an update half applied */
+static void http_stats_merge(struct http_stats_cpu *sum)
+{
+    int cpu, r, s, i;
+
+    for_each_possible_cpu (cpu) {
+        struct http_stats_cpu *pcpu = per_cpu_ptr(stats, cpu);
+
+        for (i = 0; i < HTTP_STAT_MAX; i++)
+            sum->counters[i] += pcpu->counters[i];
+        for (r = 0; r < HTTP_ROUTE_MAX; r++) {
+            sum->requests[r] += pcpu->requests[r];
+            sum->errors[r] += pcpu->errors[r];
+            for (s = 0; s < HTTP_STAGE_MAX; s++) {
+                struct http_histogram *h = &sum->hist[r][s];
+                struct http_histogram *ph = &pcpu->hist[r][s];
+
+                h->count += ph->count;
+                h->sum += ph->sum;
+                for (i = 0; i < HIST_BUCKETS; i++)
+                    h->buckets[i] += ph->buckets[i];
+            }
+        }
+    }
+}
+
+struct http_stats_buf {
+    char *buf;
+    size_t size, len; /* len keeps counting past size */
+};
+
+static __printf(2, 3) void http_stats_printf(struct http_stats_buf *b,
+                                             const char *fmt,
+                                             ...)
+{
+    size_t room = b->len < b->size ? b->size - b->len : 0;
+    va_list args;
+
+    va_start(args, fmt);
+    b->len += vsnprintf(room ? b->buf + b->len : NULL, room, fmt, args);
+    va_end(args);
+}
+
+static u64 http_stats_percentile(const struct http_histogram *h,
+                                 unsigned int pct)
+{
+    u64 rank = div_u64(h->count * pct + 99, 100), seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank && seen)
+            return http_stats_bucket_max(i);
+    }
+    return 0;
+}
+
+static void http_stats_histogram(struct http_stats_buf *b,
+                                 const struct http_histogram *h)
+{
+    bool first = true;
+    unsigned int i;
+
+    http_stats_printf(b,
+                      "{\"count\":%llu,\"mean\":%llu,\"p50\":%llu,"
+                      "\"p90\":%llu,\"p99\":%llu,\"buckets\":[",
+                      h->count, h->count ? div64_u64(h->sum, h->count) : 0,
+                      http_stats_percentile(h, 50),
+                      http_stats_percentile(h, 90),
+                      http_stats_percentile(h, 99));
+    /* Only the buckets in use, as [largest value, count] pairs */
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        if (!h->buckets[i])
+            continue;
+        http_stats_printf(b, "%s[%llu,%llu]", first ? "" : ",",
+                          http_stats_bucket_max(i), h->buckets[i]);
+        first = false;
+    }
+    http_stats_printf(b, "]}");
+}
+
+static void http_stats_json(struct http_stats_buf *b,
+                            const struct http_stats_cpu *sum)
+{
+    int r, s, i;
+
+    http_stats_printf(b, "{\"counters\":{");
+    for (i = 0; i < HTTP_STAT_MAX; i++)
+        http_stats_printf(b, "\"%s\":%llu,", counter_names[i],
+                          sum->counters[i]);
+    http_stats_printf(b,
+                      "\"timeouts\":%ld,\"evictions\":%ld,"
+                      "\"throttled_clients\":%ld},\"routes\":{",
+                      atomic_long_read(&http_timer_stats.timeouts),
+                      atomic_long_read(&http_timer_stats.evictions),
+                      atomic_long_read(&http_limit_stats.clients));
+    for (r = HTTP_ROUTE_NONE + 1; r < HTTP_ROUTE_MAX; r++) {
+        http_stats_printf(b, "%s\"%s\":{\"requests\":%llu,\"errors\":%llu",
+                          r == HTTP_ROUTE_NONE + 1 ? "" : ",", route_names[r],
+                          sum->requests[r], sum->errors[r]);
+        for (s = 0; s < HTTP_STAGE_MAX; s++) {
+            http_stats_printf(b, ",\"%s_ns\":", stage_names[s]);
+            http_stats_histogram(b, &sum->hist[r][s]);
+        }
+        http_stats_printf(b, "}");
+    }
+    http_stats_printf(b, "}}\n");
+}
+
+char *http_stats_format(size_t *len)
+{
+    struct http_stats_buf b = {};
+    struct http_stats_cpu *sum;
+
+    if (!stats)
+        return NULL;
+    sum = kvzalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum)
+        return NULL;
+    http_stats_merge(sum);
+
+    /* Measure first, the snapshot does not change in between */
+    http_stats_json(&b, sum);
+    b.size = b.len + 1;
+    b.len = 0;
+    b.buf = kvmalloc(b.size, GFP_KERNEL);
+    if (b.buf)
+        http_stats_json(&b, sum);
+    kvfree(sum);
+    *len = b.len;
+    return b.buf;
+}
+
+static int http_stats_open(struct inode *inode, struct file *file)
+{
+    struct http_stats_buf *b = kzalloc(sizeof(*b), GFP_KERNEL);
+
+    if (!b)
+        return -ENOMEM;
+    b->buf = http_stats_format(&b->len);
+    if (!b->buf) {
+        kfree(b);
+        return -ENOMEM;
+    }
+    file->private_data = b;
+    return 0;
+}
+
+static ssize_t http_stats_read(struct file *file,
+                               char __user *buf,
+                               size_t count,
+                               loff_t *ppos)
+{
+    struct http_stats_buf *b = file->private_data;
+
+    return simple_read_from_buffer(buf, count, ppos, b->buf, b->len);
+}
+
+static int http_stats_release(struct inode *inode, struct file *file)
+{
+    struct http_stats_buf *b = file->private_data;
+
+    kvfree(b->buf);
+    kfree(b);
+    return 0;
+}
+
+static const struct file_operations http_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = http_stats_open,
+    .read = http_stats_read,
+    .release = http_stats_release,
+    .llseek = default_llseek,
+};
+
+int http_stats_init(void)
+{
+    stats = alloc_percpu(struct http_stats_cpu);
+    if (!stats)
+        return -ENOMEM;
+    /* debugfs is optional, /stats works without it */
+    stats_dir = debugfs_create_dir(KBUILD_MODNAME, NULL);
+    debugfs_create_file("stats", 0444, stats_dir, NULL, &http_stats_fops);
+    return 0;
+}
+
+void http_stats_exit(void)
+{
+    debugfs_remove_recursive(stats_dir);
+    stats_dir = NULL;
+    free_percpu(stats);
+    stats = NULL;
+}
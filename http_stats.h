@@ -0,0 +1,56 @@
+#ifndef KHTTPD_HTTP_STATS_H
+#define KHTTPD_HTTP_STATS_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include "compat/user.h"
+#endif
+
+/* What served a request, every route gets its own counters and histograms */
+enum http_route {
+    HTTP_ROUTE_NONE, /* not accounted */
+    HTTP_ROUTE_FIB,
+    HTTP_ROUTE_FILE,
+    HTTP_ROUTE_PROXY,
+    HTTP_ROUTE_STATS,
+    HTTP_ROUTE_OTHER,
+    HTTP_ROUTE_MAX,
+};
+
+/* Latencies measured for each request */
+enum http_stage {
+    HTTP_STAGE_FIRST_BYTE, /* request start, accept for the first one */
+    HTTP_STAGE_PARSE,      /* first to last byte of the request */
+    HTTP_STAGE_COMPUTE,    /* response body computation, cache misses only */
+    HTTP_STAGE_SEND,       /* response queued to fully sent */
+    HTTP_STAGE_MAX,
+};
+
+enum http_counter {
+    HTTP_STAT_ACCEPTED,
+    HTTP_STAT_REFUSED, /* over max_connections */
+    HTTP_STAT_DROPPED, /* answered 503, waited or would wait too long */
+    HTTP_STAT_CLOSED,
+    HTTP_STAT_COMPUTED,  /* /fib cache misses computed */
+    HTTP_STAT_COALESCED, /* /fib cache misses that joined a computation */
+    HTTP_STAT_THROTTLED, /* answered 429, client over its rate limit */
+    HTTP_STAT_LOG_DROPPED, /* access log records the reader missed */
+    HTTP_STAT_MAX,
+};
+
+extern int http_stats_init(void);
+extern void http_stats_exit(void);
+
+/* Lock-free per-CPU updates, cheap enough to stay on at full load */
+extern void http_stats_count(enum http_counter counter);
+extern void http_stats_request(enum http_route route);
+extern void http_stats_error(enum http_route route);
+extern void http_stats_record(enum http_route route,
+                              enum http_stage stage,
+                              u64 ns);
+
+/* Snapshot of every CPU as JSON, release with kvfree() */
+extern char *http_stats_format(size_t *len);
+
+#endif
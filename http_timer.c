@@ -0,0 +1,211 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/cpumask.h>
+#include <linux/jiffies.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+
+#include "http_timer.h"
+
+#define WHEEL_SLOTS 64 /* power of two */
+#define WHEEL_TICK HZ
+
+struct http_timer_wheel {
+    struct mutex lock; /* expiry callbacks sleep, so no spinlock */
+    struct list_head slots[WHEEL_SLOTS];
+    struct list_head idle; /* idle timers of this wheel, oldest first */
+    unsigned long clock; /* next tick to process */
+    struct delayed_work tick;
+    int cpu;
+    bool running;
+};
+
+struct http_timer_stats http_timer_stats;
+
+static DEFINE_PER_CPU(struct http_timer_wheel, wheels);
+static bool track_idle;
+
+static void http_timer_tick(struct work_struct *work)
+{
+    struct http_timer_wheel *wheel =
+        container_of(to_delayed_work(work), struct http_timer_wheel, tick);
+    unsigned long now = jiffies, tick = now / WHEEL_TICK;
+    struct http_timer *timer, *tmp;
+
+    mutex_lock(&wheel->lock);
+    /* Catch up on ticks missed while the work was delayed */
+    if (tick - wheel->clock >= WHEEL_SLOTS)
+        wheel->clock = tick - WHEEL_SLOTS + 1;
+    for (; !time_after(wheel->clock, tick); wheel->clock++) {
+        struct list_head *slot =
+            &wheel->slots[wheel->clock & (WHEEL_SLOTS - 1)];
+        /* Deadlines more than a lap away share the slot, skip them */
+        list_for_each_entry_safe (timer, tmp, slot, node) {
+            if (time_before(now, timer->expires))
+                continue;
+            list_del_init(&timer->node);
+            /* On its way out already, nothing to evict */
+            list_del_init(&timer->lru);
+            atomic_long_inc(&http_timer_stats.timeouts);
+            timer->function(timer);
+        }
+    }
+    mutex_unlock(&wheel->lock);
+
+    queue_delayed_work_on(wheel->cpu, system_wq, &wheel->tick, WHEEL_TICK);
+}
+
+void http_timer_init(struct http_timer *timer,
+                     void (*function)(struct http_timer *timer))
+{
+    INIT_LIST_HEAD(&timer->node);
+    INIT_LIST_HEAD(&timer->lru);
+    timer->cpu = -1;
+    timer->evicted = false;
+    timer->function = function;
+}
+
+/* A timer stays on the wheel of the CPU it was first armed on */
+static struct http_timer_wheel *http_timer_wheel(struct http_timer *timer)
+{
+    if (timer->cpu < 0) {
+        timer->cpu = raw_smp_processor_id();
+        if (!per_cpu(wheels, timer->cpu).running)
+            timer->cpu = cpumask_first(cpu_online_mask);
+    }
+    return &per_cpu(wheels, timer->cpu);
+}
+
+void http_timer_arm(struct http_timer *timer, unsigned long timeout, bool idle)
+{
+    struct http_timer_wheel *wheel;
+    unsigned long tick;
+
+    idle = idle && READ_ONCE(track_idle);
+    /* Never armed nor idle, there is nothing to take off */
+    if (!timeout && !idle && timer->cpu < 0)
+        return;
+    wheel = http_timer_wheel(timer);
+
+    mutex_lock(&wheel->lock);
+    if (timeout) {
+        timer->expires = jiffies + timeout;
+        tick = DIV_ROUND_UP(timer->expires, WHEEL_TICK);
+        list_move_tail(&timer->node, &wheel->slots[tick & (WHEEL_SLOTS - 1)]);
+    } else {
+        list_del_init(&timer->node);
+    }
+    /*
+     * The idle list only changes as the owner goes idle or busy, with or
+     * without a deadline; an evicted timer is not put back on it.
+     */
+    if (idle && list_empty(&timer->lru) && !timer->evicted) {
+        timer->idle_since = jiffies;
+        list_add_tail(&timer->lru, &wheel->idle);
+    } else if (!idle) {
+        list_del_init(&timer->lru);
+    }
+    mutex_unlock(&wheel->lock);
+}
+
+void http_timer_del(struct http_timer *timer)
+{
+    struct http_timer_wheel *wheel;
+
+    if (timer->cpu < 0)
+        return;
+    wheel = &per_cpu(wheels, timer->cpu);
+
+    mutex_lock(&wheel->lock);
+    list_del_init(&timer->node);
+    list_del_init(&timer->lru);
+    mutex_unlock(&wheel->lock);
+}
+
+/* Wheel whose idle list starts with the oldest idle timer, NULL if none */
+static struct http_timer_wheel *http_timer_oldest_idle(void)
+{
+    struct http_timer_wheel *wheel, *oldest = NULL;
+    unsigned long since = 0;
+    struct http_timer *timer;
+    int cpu;
+
+    for_each_possible_cpu (cpu) {
+        wheel = &per_cpu(wheels, cpu);
+        mutex_lock(&wheel->lock);
+        timer = list_first_entry_or_null(&wheel->idle, struct http_timer, lru);
+        if (timer && (!oldest || time_before(timer->idle_since, since))) {
+            oldest = wheel;
+            since = timer->idle_since;
+        }
+        mutex_unlock(&wheel->lock);
+    }
+    return oldest;
+}
+
+bool http_timer_evict_idle(void)
+{
+    struct http_timer_wheel *wheel;
+    struct http_timer *timer = NULL;
+
+    /* The head found may have left meanwhile, then look again */
+    while (!timer && (wheel = http_timer_oldest_idle())) {
+        mutex_lock(&wheel->lock);
+        timer = list_first_entry_or_null(&wheel->idle, struct http_timer, lru);
+        if (timer) {
+            /* Holding the wheel lock keeps the owner in http_timer_del() */
+            list_del_init(&timer->lru);
+            atomic_long_inc(&http_timer_stats.evictions);
+            timer->evicted = true;
+            timer->function(timer);
+        }
+        mutex_unlock(&wheel->lock);
+    }
+    return timer != NULL;
+}
+
+void http_timer_track_idle(void)
+{
+    WRITE_ONCE(track_idle, true);
+}
+
+int http_timer_wheel_init(bool evictable)
+{
+    int cpu, i;
+
+    track_idle = evictable;
+    atomic_long_set(&http_timer_stats.timeouts, 0);
+    atomic_long_set(&http_timer_stats.evictions, 0);
+    for_each_possible_cpu (cpu) {
+        struct http_timer_wheel *wheel = &per_cpu(wheels, cpu);
+
+        mutex_init(&wheel->lock);
+        for (i = 0; i < WHEEL_SLOTS; i++)
+            INIT_LIST_HEAD(&wheel->slots[i]);
+        INIT_LIST_HEAD(&wheel->idle);
+        wheel->clock = jiffies / WHEEL_TICK;
+        wheel->cpu = cpu;
+        INIT_DELAYED_WORK(&wheel->tick, http_timer_tick);
+    }
+    for_each_online_cpu (cpu) {
+        struct http_timer_wheel *wheel = &per_cpu(wheels, cpu);
+
+        wheel->running = true;
+        queue_delayed_work_on(cpu, system_wq, &wheel->tick, WHEEL_TICK);
+    }
+    return 0;
+}
+
+void http_timer_wheel_exit(void)
+{
+    int cpu;
+
+    for_each_possible_cpu (cpu) {
+        struct http_timer_wheel *wheel = &per_cpu(wheels, cpu);
+
+        if (wheel->running)
+            cancel_delayed_work_sync(&wheel->tick);
+        wheel->running = false;
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef KHTTPD_HTTP_TIMER_H
+#define KHTTPD_HTTP_TIMER_H
+
+#ifdef __KERNEL__
+#include <linux/atomic.h>
+#include <linux/list.h>
+#else
+#include "compat/user.h"
+#endif
+
+/*
+ * Connection deadline kept on a per-CPU hashed timer wheel with one second
+ * resolution. Expiry runs in process context and may sleep; the callback
+ * only has to make the owner notice, the owner tears the timer down with
+ * http_timer_del() before freeing it.
+ */
+struct http_timer {
+    struct list_head node; /* wheel slot */
+    struct list_head lru;  /* idle list of its wheel, oldest first */
+    unsigned long expires;
+    unsigned long idle_since; /* jiffies, while on the idle list */
+    int cpu; /* wheel the timer lives on, -1 before it is first armed */
+    bool evicted; /* fired by http_timer_evict_idle() */
+    void (*function)(struct http_timer *timer);
+};
+
+struct http_timer_stats {
+    atomic_long_t timeouts;
+    atomic_long_t evictions;
+};
+
+extern struct http_timer_stats http_timer_stats;
+
+/* @evictable: keep the idle list needed by http_timer_evict_idle() */
+extern int http_timer_wheel_init(bool evictable);
+extern void http_timer_wheel_exit(void);
+
+/* Start keeping the idle list, for good: timers may be on it from now on */
+extern void http_timer_track_idle(void);
+
+extern void http_timer_init(struct http_timer *timer,
+                            void (*function)(struct http_timer *timer));
+
+/*
+ * (Re)arm to fire after @timeout jiffies, 0 takes it off the wheel. @idle
+ * keeps it on the idle list for eviction, whether it has a deadline or not.
+ */
+extern void http_timer_arm(struct http_timer *timer,
+                           unsigned long timeout,
+                           bool idle);
+extern void http_timer_del(struct http_timer *timer);
+
+/*
+ * Fire the timer that has been idle the longest, false if there is none. It
+ * is flagged evicted for its owner to tell once http_timer_del() returned.
+ */
+extern bool http_timer_evict_idle(void);
+
+#endif
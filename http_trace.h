@@ -0,0 +1,155 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM khttpd
+
+#if !defined(KHTTPD_HTTP_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define KHTTPD_HTTP_TRACE_H
+
+#include <linux/net.h>
+#include <linux/tracepoint.h>
+
+#include "http_stats.h"
+
+/*
+ * Connections are identified by their socket address in every event, so a
+ * request can be followed from accept to close with a filter on sk.
+ */
+
+TRACE_DEFINE_ENUM(HTTP_ROUTE_NONE);
+TRACE_DEFINE_ENUM(HTTP_ROUTE_FIB);
+TRACE_DEFINE_ENUM(HTTP_ROUTE_FILE);
+TRACE_DEFINE_ENUM(HTTP_ROUTE_PROXY);
+TRACE_DEFINE_ENUM(HTTP_ROUTE_STATS);
+TRACE_DEFINE_ENUM(HTTP_ROUTE_OTHER);
+
+#define show_http_route(route)                                              \
+    __print_symbolic(route, {HTTP_ROUTE_NONE, "none"},                      \
+                     {HTTP_ROUTE_FIB, "fib"}, {HTTP_ROUTE_FILE, "file"},    \
+                     {HTTP_ROUTE_PROXY, "proxy"},                           \
+                     {HTTP_ROUTE_STATS, "stats"},                           \
+                     {HTTP_ROUTE_OTHER, "other"})
+
+TRACE_EVENT(khttpd_accept,
+
+            TP_PROTO(const struct socket *socket, int cpu),
+
+            TP_ARGS(socket, cpu),
+
+            TP_STRUCT__entry(__field(const void *, sk) __field(int, cpu)),
+
+            TP_fast_assign(__entry->sk = socket->sk; __entry->cpu = cpu;),
+
+            TP_printk("sk=%p listener_cpu=%d", __entry->sk, __entry->cpu));
+
+DECLARE_EVENT_CLASS(khttpd_conn,
+
+                    TP_PROTO(const struct socket *socket),
+
+                    TP_ARGS(socket),
+
+                    TP_STRUCT__entry(__field(const void *, sk)),
+
+                    TP_fast_assign(__entry->sk = socket->sk;),
+
+                    TP_printk("sk=%p", __entry->sk));
+
+DEFINE_EVENT(khttpd_conn,
+             khttpd_parse_start,
+             TP_PROTO(const struct socket *socket),
+             TP_ARGS(socket));
+
+DEFINE_EVENT(khttpd_conn,
+             khttpd_close,
+             TP_PROTO(const struct socket *socket),
+             TP_ARGS(socket));
+
+TRACE_EVENT(khttpd_parse_complete,
+
+            TP_PROTO(const struct socket *socket,
+                     const char *method,
+                     const char *url,
+                     size_t url_len,
+                     int keep_alive),
+
+            TP_ARGS(socket, method, url, url_len, keep_alive),
+
+            /* The URL is a slice of the request, terminated on copy */
+            TP_STRUCT__entry(__field(const void *, sk) __string(method, method)
+                                 __dynamic_array(char, url, url_len + 1)
+                                     __field(int, keep_alive)),
+
+            TP_fast_assign(__entry->sk = socket->sk;
+                           __assign_str(method, method);
+                           memcpy(__get_str(url), url, url_len);
+                           __get_str(url)[url_len] = '\0';
+                           __entry->keep_alive = keep_alive;),
+
+            TP_printk("sk=%p %s %s keep_alive=%d",
+                      __entry->sk,
+                      __get_str(method),
+                      __get_str(url),
+                      __entry->keep_alive));
+
+TRACE_EVENT(khttpd_route,
+
+            TP_PROTO(const struct socket *socket, enum http_route route),
+
+            TP_ARGS(socket, route),
+
+            TP_STRUCT__entry(__field(const void *, sk) __field(int, route)),
+
+            TP_fast_assign(__entry->sk = socket->sk; __entry->route = route;),
+
+            TP_printk("sk=%p route=%s",
+                      __entry->sk,
+                      show_http_route(__entry->route)));
+
+TRACE_EVENT(khttpd_compute_start,
+
+            TP_PROTO(long long n),
+
+            TP_ARGS(n),
+
+            TP_STRUCT__entry(__field(long long, n)),
+
+            TP_fast_assign(__entry->n = n;),
+
+            TP_printk("n=%lld", __entry->n));
+
+TRACE_EVENT(khttpd_compute_end,
+
+            TP_PROTO(long long n, size_t digits),
+
+            TP_ARGS(n, digits),
+
+            TP_STRUCT__entry(__field(long long, n) __field(size_t, digits)),
+
+            TP_fast_assign(__entry->n = n; __entry->digits = digits;),
+
+            TP_printk("n=%lld digits=%zu", __entry->n, __entry->digits));
+
+/* One response, from being queued to its last byte taken by the socket */
+TRACE_EVENT(khttpd_send,
+
+            TP_PROTO(const struct socket *socket, size_t bytes, u64 duration),
+
+            TP_ARGS(socket, bytes, duration),
+
+            TP_STRUCT__entry(__field(const void *, sk) __field(size_t, bytes)
+                                 __field(u64, duration)),
+
+            TP_fast_assign(__entry->sk = socket->sk; __entry->bytes = bytes;
+                           __entry->duration = duration;),
+
+            TP_printk("sk=%p bytes=%zu duration_ns=%llu",
+                      __entry->sk,
+                      __entry->bytes,
+                      __entry->duration));
+
+#endif
+
+/* Out of tree, the header is found through -I$(src) */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE http_trace
+#include <trace/define_trace.h>
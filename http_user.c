@@ -0,0 +1,168 @@
+/*
+ * The request path of khttpd as a userspace epoll server, to benchmark it
+ * with htstress and debug it without loading the module:
+ *
+ *   $ make khttpd-user && ./khttpd-user -p 8081 -t 4
+ *
+ * Every thread accepts on a SO_REUSEPORT listener of its own and serves
+ * its connections with non-blocking I/O, like an event-driven worker.
+ */
+
+#include <getopt.h>
+#include <sys/epoll.h>
+
+#include "http_server.h"
+
+#define MAX_EVENTS 64
+
+/* Connection as the event loop sees it */
+struct user_conn {
+    struct http_conn *conn;
+    int fd;
+    bool writing; /* waiting for EPOLLOUT rather than EPOLLIN */
+};
+
+static unsigned short port = 8081;
+
+static int user_listen(void)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_port = htons(port),
+                               .sin_addr.s_addr = htonl(INADDR_ANY)};
+    int fd, one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        return -errno;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) ||
+        bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+        listen(fd, SOMAXCONN)) {
+        close(fd);
+        return -errno;
+    }
+    return fd;
+}
+
+static void user_accept(int epfd, int lfd)
+{
+    struct epoll_event ev = {.events = EPOLLIN};
+    struct user_conn *uc;
+    int fd;
+
+    while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+        uc = malloc(sizeof(*uc));
+        if (uc)
+            uc->conn = http_user_conn_open(fd);
+        if (!uc || !uc->conn) {
+            free(uc);
+            close(fd);
+            continue;
+        }
+        uc->fd = fd;
+        uc->writing = false;
+        ev.data.ptr = uc;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+            http_user_conn_close(uc->conn);
+            free(uc);
+        }
+    }
+}
+
+static void user_serve(int epfd, struct user_conn *uc, char *buf)
+{
+    struct epoll_event ev = {.data.ptr = uc};
+    int ret = http_user_conn_process(uc->conn, buf);
+
+    if (ret < 0) {
+        /* Closing the descriptor takes it out of the epoll set */
+        http_user_conn_close(uc->conn);
+        free(uc);
+        return;
+    }
+    if (uc->writing == !!ret)
+        return;
+    uc->writing = ret;
+    ev.events = ret ? EPOLLOUT : EPOLLIN;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, uc->fd, &ev);
+}
+
+static void *user_loop(void *arg)
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    int lfd, epfd, i, n;
+    char *buf;
+
+    lfd = user_listen();
+    if (lfd < 0) {
+        fprintf(stderr, "can't listen on port %u: %s\n", port,
+                strerror(-lfd));
+        exit(1);
+    }
+    epfd = epoll_create1(0);
+    buf = http_user_buf_alloc();
+    if (epfd < 0 || !buf || epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev)) {
+        perror("epoll");
+        exit(1);
+    }
+
+    for (;;) {
+        n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        for (i = 0; i < n; i++) {
+            if (!events[i].data.ptr)
+                user_accept(epfd, lfd);
+            else
+                user_serve(epfd, events[i].data.ptr, buf);
+        }
+    }
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-p port] [-t threads]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct http_server_param param = {
+        .batch_max = 1000,
+        .batch_cost = 100000,
+    };
+    long i, nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t *threads;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:t:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 't':
+            nr_threads = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (nr_threads < 1)
+        usage(argv[0]);
+
+    if (http_user_start(&param) || http_server_register_builtins()) {
+        fprintf(stderr, "can't start the server\n");
+        return 1;
+    }
+    threads = calloc(nr_threads, sizeof(*threads));
+    if (!threads)
+        return 1;
+    for (i = 0; i < nr_threads; i++)
+        if (pthread_create(&threads[i], NULL, user_loop, NULL)) {
+            perror("pthread_create");
+            return 1;
+        }
+    for (i = 0; i < nr_threads; i++)
+        pthread_join(threads[i], NULL);
+    return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * Print the binary access log of khttpd as text, one response per line:
+ *
+ *   $ sudo ./khttpd-log [-f] [file]
+ *
+ * Records are drained, so every one is printed once. With -f the log is
+ * followed like tail -f does.
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "http_log.h"
+
+#define LOG_FILE "/sys/kernel/debug/khttpd/access_log"
+#define LOG_BATCH 256
+#define POLL_INTERVAL 100000 /* us */
+
+/* enum http_route, in order */
+static const char *const routes[] = {
+    "-", "fib", "file", "proxy", "stats", "other",
+};
+
+static long long clock_ns(clockid_t id)
+{
+    struct timespec ts;
+
+    clock_gettime(id, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Wall clock time, client, route, status, N, bytes, latency in ms */
+static void print_record(const struct http_log_record *r, long long offset)
+{
+    char addr[INET_ADDRSTRLEN], when[32];
+    long long real = r->time + offset;
+    time_t sec = real / 1000000000;
+    struct tm tm;
+
+    if (r->dropped)
+        printf("# %u records lost on CPU %u\n", r->dropped, r->cpu);
+    inet_ntop(AF_INET, &r->addr, addr, sizeof(addr));
+    gmtime_r(&sec, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+    printf("%s.%06lldZ %s %s %u ", when, real % 1000000000 / 1000, addr,
+           r->route < sizeof(routes) / sizeof(routes[0]) ? routes[r->route]
+                                                         : "?",
+           r->status);
+    if (r->n >= 0)
+        printf("%lld", (long long) r->n);
+    else
+        putchar('-');
+    printf(" %llu %.3f\n", (unsigned long long) r->bytes, r->latency / 1e6);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-f] [file]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct http_log_record records[LOG_BATCH];
+    long long offset;
+    int opt, fd, follow = 0;
+    ssize_t len, i;
+
+    while ((opt = getopt(argc, argv, "f")) != -1) {
+        if (opt != 'f')
+            usage(argv[0]);
+        follow = 1;
+    }
+    fd = open(optind < argc ? argv[optind] : LOG_FILE, O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+    /* Records carry CLOCK_MONOTONIC times */
+    offset = clock_ns(CLOCK_REALTIME) - clock_ns(CLOCK_MONOTONIC);
+
+    for (;;) {
+        len = read(fd, records, sizeof(records));
+        if (len < 0) {
+            perror("read");
+            return 1;
+        }
+        for (i = 0; i < len / (ssize_t) sizeof(records[0]); i++)
+            print_record(&records[i], offset);
+        if (len)
+            continue;
+        if (!follow)
+            break;
+        fflush(stdout);
+        usleep(POLL_INTERVAL);
+    }
+    close(fd);
+    return 0;
+}
@@ -1,24 +1,149 @@
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
 #include <linux/kthread.h>
+#include <linux/mutex.h>
 #include <linux/sched/signal.h>
 #include <linux/tcp.h>
 #include <net/sock.h>
 
+#include "http_cache.h"
+#include "http_file.h"
+#include "http_limit.h"
+#include "http_log.h"
+#include "http_proxy.h"
 #include "http_server.h"
+#include "http_stats.h"
+#include "http_timer.h"
 #include "bignum.h"
 
 #define DEFAULT_PORT 8081
 #define DEFAULT_BACKLOG 100
+#define DEFAULT_CACHE_SIZE 16384
+#define DEFAULT_COMPRESS_MIN 1024
+#define DEFAULT_PROXY_POOL_SIZE 8
+#define DEFAULT_IDLE_TIMEOUT 60
+#define DEFAULT_HEADER_TIMEOUT 10
+#define DEFAULT_QUEUE_DEPTH 1024
+#define DEFAULT_QUEUE_DELAY 500
+#define DEFAULT_BATCH_MAX 1000
+#define DEFAULT_BATCH_COST 100000
+#define DEFAULT_LIMIT_BURST 50000
+#define DEFAULT_LOG_SIZE 1024
+
+static int khttpd_apply(void);
+
+/*
+ * Parameters that can also be written under /sys/module/khttpd/parameters
+ * while the server runs. The server takes the new value right away, or the
+ * write fails and the old value stays.
+ */
+#define PARAM_OPS_LIVE(type)                                              \
+    static int param_set_live_##type(const char *val,                     \
+                                     const struct kernel_param *kp)       \
+    {                                                                     \
+        type old = *(type *) kp->arg;                                     \
+        int err = param_set_##type(val, kp);                              \
+                                                                          \
+        if (!err) {                                                       \
+            err = khttpd_apply();                                         \
+            if (err)                                                      \
+                *(type *) kp->arg = old;                                  \
+        }                                                                 \
+        return err;                                                       \
+    }                                                                     \
+    static const struct kernel_param_ops param_ops_live_##type = {        \
+        .set = param_set_live_##type,                                     \
+        .get = param_get_##type,                                          \
+    }
+
+PARAM_OPS_LIVE(ushort);
+PARAM_OPS_LIVE(uint);
+PARAM_OPS_LIVE(ulong);
+
+#define module_param_live(name, type)                                     \
+    module_param_cb(name, &param_ops_live_##type, &name, S_IRUGO | S_IWUSR)
 
 static ushort port = DEFAULT_PORT;
-module_param(port, ushort, S_IRUGO);
+module_param_live(port, ushort);
 static ushort backlog = DEFAULT_BACKLOG;
-module_param(backlog, ushort, S_IRUGO);
+module_param_live(backlog, ushort);
+static uint nr_workers;
+module_param_live(nr_workers, uint);
+MODULE_PARM_DESC(nr_workers, "worker threads in the pool (0: one per CPU)");
+static bool event_driven;
+module_param(event_driven, bool, S_IRUGO);
+MODULE_PARM_DESC(event_driven, "multiplex connections over the workers");
+static char *cpus = "";
+module_param(cpus, charp, S_IRUGO);
+MODULE_PARM_DESC(cpus, "run on these CPUs only, as a list like 2-5,8");
+static bool affinity;
+module_param(affinity, bool, S_IRUGO);
+MODULE_PARM_DESC(affinity, "pin each worker to its CPU");
+static uint cache_size = DEFAULT_CACHE_SIZE;
+module_param_live(cache_size, uint);
+MODULE_PARM_DESC(cache_size, "response cache budget in KiB (0: disabled)");
+static uint compress_min = DEFAULT_COMPRESS_MIN;
+module_param_live(compress_min, uint);
+MODULE_PARM_DESC(compress_min, "deflate cached bodies from this size (0: off)");
+static char *docroot = "";
+module_param(docroot, charp, S_IRUGO);
+MODULE_PARM_DESC(docroot, "serve other paths from this directory");
+static char *upstream = "";
+module_param(upstream, charp, S_IRUGO);
+MODULE_PARM_DESC(upstream, "proxy other paths to these addr:port backends");
+static uint proxy_pool_size = DEFAULT_PROXY_POOL_SIZE;
+module_param(proxy_pool_size, uint, S_IRUGO);
+MODULE_PARM_DESC(proxy_pool_size, "idle keep-alive connections per backend");
+static bool proxy_least_conn;
+module_param(proxy_least_conn, bool, S_IRUGO);
+MODULE_PARM_DESC(proxy_least_conn, "least-connections instead of round-robin");
+static uint idle_timeout = DEFAULT_IDLE_TIMEOUT;
+module_param_live(idle_timeout, uint);
+MODULE_PARM_DESC(idle_timeout, "seconds a keep-alive client may idle");
+static uint header_timeout = DEFAULT_HEADER_TIMEOUT;
+module_param_live(header_timeout, uint);
+MODULE_PARM_DESC(header_timeout, "seconds to receive a complete request");
+static uint max_connections;
+module_param_live(max_connections, uint);
+MODULE_PARM_DESC(max_connections, "connection cap, evicts idle (0: no cap)");
+static uint queue_depth = DEFAULT_QUEUE_DEPTH;
+module_param(queue_depth, uint, S_IRUGO);
+MODULE_PARM_DESC(queue_depth, "accepted connections waiting for a worker");
+static uint queue_delay = DEFAULT_QUEUE_DELAY;
+module_param_live(queue_delay, uint);
+MODULE_PARM_DESC(queue_delay, "ms a connection may wait for a worker (0: any)");
+static uint batch_max = DEFAULT_BATCH_MAX;
+module_param_live(batch_max, uint);
+MODULE_PARM_DESC(batch_max, "numbers a POST /fib/batch may ask for");
+static ulong batch_cost = DEFAULT_BATCH_COST;
+module_param_live(batch_cost, ulong);
+MODULE_PARM_DESC(batch_cost, "largest sum of the numbers of a batch");
+static uint limit_rate;
+module_param_live(limit_rate, uint);
+MODULE_PARM_DESC(limit_rate, "tokens a second per client address (0: off)");
+static uint limit_burst = DEFAULT_LIMIT_BURST;
+module_param_live(limit_burst, uint);
+MODULE_PARM_DESC(limit_burst,
+                 "tokens a client address may spend at once, and the most "
+                 "a single request is charged");
+static uint log_size = DEFAULT_LOG_SIZE;
+module_param(log_size, uint, S_IRUGO);
+MODULE_PARM_DESC(log_size, "access log records buffered per CPU (0: off)");
+static bool reuseport;
+module_param(reuseport, bool, S_IRUGO);
+MODULE_PARM_DESC(reuseport, "one SO_REUSEPORT listener per CPU");
+static bool incoming_cpu;
+module_param(incoming_cpu, bool, S_IRUGO);
+MODULE_PARM_DESC(incoming_cpu, "set SO_INCOMING_CPU on reuseport listeners");
 
-static struct socket *listen_socket;
 static struct http_server_param param;
-static struct task_struct *http_server;
+static struct cpumask khttpd_cpus;
+static struct http_listener *listeners;
+static unsigned int nr_listeners;
+static ushort listen_port, listen_backlog; /* of the open listeners */
+/* Orders khttpd_apply() against loading and unloading */
+static DEFINE_MUTEX(config_lock);
+static bool running;
 
 static inline int setsockopt(struct socket *sock,
                              int level,
@@ -29,7 +154,10 @@ static inline int setsockopt(struct socket *sock,
     return kernel_setsockopt(sock, level, optname, (char *) &opt, sizeof(opt));
 }
 
-static int open_listen_socket(ushort port, ushort backlog, struct socket **res)
+static int open_listen_socket(ushort port,
+                              ushort backlog,
+                              int cpu,
+                              struct socket **res)
 {
     struct socket *sock;
     struct sockaddr_in s;
@@ -44,6 +172,18 @@ static int open_listen_socket(ushort port, ushort backlog, struct socket **res)
     if (err < 0)
         goto bail_setsockopt;
 
+    if (reuseport) {
+        err = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, 1);
+        if (err < 0)
+            goto bail_setsockopt;
+    }
+
+    if (cpu >= 0 && incoming_cpu) {
+        err = setsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, cpu);
+        if (err < 0)
+            goto bail_setsockopt;
+    }
+
     err = setsockopt(sock, SOL_TCP, TCP_NODELAY, 1);
     if (err < 0)
         goto bail_setsockopt;
@@ -91,28 +231,263 @@ static void close_listen_socket(struct socket *socket)
     sock_release(socket);
 }
 
-static int __init khttpd_init(void)
+/* Open a listen socket and start its accept thread, pinned when cpu >= 0 */
+static int start_listener(struct http_listener *listener, int cpu)
 {
-    int err = open_listen_socket(port, backlog, &listen_socket);
+    int err = open_listen_socket(port, backlog, cpu, &listener->socket);
     if (err < 0) {
         pr_err("can't open listen socket\n");
         return err;
     }
-    param.listen_socket = listen_socket;
-    http_server = kthread_run(http_server_daemon, &param, KBUILD_MODNAME);
-    if (IS_ERR(http_server)) {
+    listener->cpu = cpu;
+    if (cpu < 0) {
+        listener->daemon =
+            kthread_create(http_server_daemon, listener, KBUILD_MODNAME);
+        /* Floats, but only over the CPUs khttpd may use */
+        if (!IS_ERR(listener->daemon))
+            set_cpus_allowed_ptr(listener->daemon, &khttpd_cpus);
+    } else {
+        listener->daemon = kthread_create_on_node(
+            http_server_daemon, listener, cpu_to_node(cpu),
+            KBUILD_MODNAME "-accept/%d", cpu);
+    }
+    if (IS_ERR(listener->daemon)) {
         pr_err("can't start http server daemon\n");
-        close_listen_socket(listen_socket);
-        return PTR_ERR(http_server);
+        close_listen_socket(listener->socket);
+        return PTR_ERR(listener->daemon);
+    }
+    if (cpu >= 0)
+        kthread_bind(listener->daemon, cpu);
+    wake_up_process(listener->daemon);
+    return 0;
+}
+
+static void stop_listener(struct http_listener *listener)
+{
+    send_sig(SIGTERM, listener->daemon, 1);
+    kthread_stop(listener->daemon);
+    close_listen_socket(listener->socket);
+}
+
+static void stop_listeners(struct http_listener *set, unsigned int nr)
+{
+    while (nr)
+        stop_listener(&set[--nr]);
+    kfree(set);
+}
+
+/*
+ * Open one listener, or one per CPU with reuseport, on the current port and
+ * only then close the ones open before, so a port that can't be had leaves
+ * the server where it was.
+ */
+static int start_listeners(void)
+{
+    unsigned int nr = 0, max = reuseport ? cpumask_weight(&khttpd_cpus) : 1;
+    struct http_listener *set;
+    int cpu, err;
+
+    set = kcalloc(max, sizeof(struct http_listener), GFP_KERNEL);
+    if (!set)
+        return -ENOMEM;
+
+    if (!reuseport) {
+        err = start_listener(&set[0], -1);
+        if (err < 0)
+            goto bail;
+        nr = 1;
     }
+    for_each_cpu (cpu, &khttpd_cpus) {
+        if (nr == max)
+            break;
+        err = start_listener(&set[nr], cpu);
+        if (err < 0)
+            goto bail;
+        nr++;
+    }
+
+    stop_listeners(listeners, nr_listeners);
+    listeners = set;
+    nr_listeners = nr;
+    listen_port = port;
+    listen_backlog = backlog;
     return 0;
+
+bail:
+    stop_listeners(set, nr);
+    return err;
+}
+
+/* Settings of the server that can change while it runs */
+static void khttpd_set_param(void)
+{
+    param.nr_workers = nr_workers ? nr_workers : cpumask_weight(&khttpd_cpus);
+    param.idle_timeout = idle_timeout;
+    param.header_timeout = header_timeout;
+    param.max_connections = max_connections;
+    param.queue_delay = queue_delay;
+    param.batch_max = batch_max;
+    param.batch_cost = batch_cost;
+}
+
+/* Bring the running server in line with the parameters after a write */
+static int khttpd_apply(void)
+{
+    unsigned int i;
+    int err = 0;
+
+    mutex_lock(&config_lock);
+    /* Loading picks the value up, unloading doesn't care */
+    if (!running)
+        goto out;
+
+    khttpd_set_param();
+    err = http_server_reconfigure(&param);
+    if (err < 0)
+        goto out;
+    if (max_connections)
+        http_timer_track_idle();
+    err = http_limit_set(limit_rate, limit_burst);
+    if (err < 0)
+        goto out;
+    err = http_cache_set((size_t) cache_size * 1024, compress_min);
+    if (err < 0)
+        goto out;
+
+    if (port != listen_port) {
+        err = start_listeners();
+    } else if (backlog != listen_backlog) {
+        /* listen() on a listening socket only resizes its backlog */
+        for (i = 0; i < nr_listeners && !err; i++)
+            err = kernel_listen(listeners[i].socket, backlog);
+        if (!err)
+            listen_backlog = backlog;
+    }
+out:
+    mutex_unlock(&config_lock);
+    return err;
+}
+
+static int __init khttpd_start(void)
+{
+    int err;
+
+    cpumask_copy(&khttpd_cpus, cpu_online_mask);
+    if (*cpus) {
+        err = cpulist_parse(cpus, &khttpd_cpus);
+        if (err < 0) {
+            pr_err("invalid CPU list: %s\n", cpus);
+            return err;
+        }
+        cpumask_and(&khttpd_cpus, &khttpd_cpus, cpu_online_mask);
+        if (cpumask_empty(&khttpd_cpus)) {
+            pr_err("no online CPU in %s\n", cpus);
+            return -EINVAL;
+        }
+    }
+    param.cpus = &khttpd_cpus;
+    param.event_driven = event_driven;
+    /*
+     * Keep connections on the CPU whose listener accepted them, and keep
+     * workers off the CPUs they were not given
+     */
+    param.bind_workers = reuseport || affinity || *cpus;
+    param.queue_depth = queue_depth ? queue_depth : DEFAULT_QUEUE_DEPTH;
+    khttpd_set_param();
+    err = http_stats_init();
+    if (err < 0) {
+        pr_err("can't set up statistics\n");
+        return err;
+    }
+    err = http_log_init(log_size);
+    if (err < 0) {
+        pr_err("can't set up access log\n");
+        goto bail_log;
+    }
+    err = http_cache_init((size_t) cache_size * 1024, compress_min);
+    if (err < 0) {
+        pr_err("can't set up response cache\n");
+        goto bail_cache;
+    }
+    err = http_file_init(docroot);
+    if (err < 0) {
+        pr_err("can't set up document root\n");
+        goto bail_file;
+    }
+    err = http_proxy_init(upstream, proxy_pool_size, proxy_least_conn);
+    if (err < 0) {
+        pr_err("can't set up upstreams\n");
+        goto bail_proxy;
+    }
+    err = http_server_register_builtins();
+    if (err < 0) {
+        pr_err("can't register handlers\n");
+        goto bail_builtins;
+    }
+    http_timer_wheel_init(max_connections != 0);
+    err = http_limit_init(limit_rate, limit_burst);
+    if (err < 0) {
+        pr_err("can't set up rate limiting\n");
+        goto bail_limit;
+    }
+    err = http_server_pool_start(&param);
+    if (err < 0) {
+        pr_err("can't start worker pool\n");
+        goto bail_pool;
+    }
+    err = start_listeners();
+    if (err < 0)
+        goto bail_listeners;
+    return 0;
+
+bail_listeners:
+    http_server_pool_stop();
+bail_pool:
+    http_limit_exit();
+bail_limit:
+    http_timer_wheel_exit();
+    http_server_unregister_builtins();
+bail_builtins:
+    http_proxy_exit();
+bail_proxy:
+    http_file_exit();
+bail_file:
+    http_cache_exit();
+bail_cache:
+    http_log_exit();
+bail_log:
+    http_stats_exit();
+    return err;
+}
+
+static int __init khttpd_init(void)
+{
+    int err;
+
+    /* The parameters are writable before this runs */
+    mutex_lock(&config_lock);
+    err = khttpd_start();
+    running = !err;
+    mutex_unlock(&config_lock);
+    return err;
 }
 
 static void __exit khttpd_exit(void)
 {
-    send_sig(SIGTERM, http_server, 1);
-    kthread_stop(http_server);
-    close_listen_socket(listen_socket);
+    mutex_lock(&config_lock);
+    running = false;
+    mutex_unlock(&config_lock);
+
+    stop_listeners(listeners, nr_listeners);
+    http_server_pool_stop();
+    http_limit_exit();
+    http_timer_wheel_exit();
+    http_server_unregister_builtins();
+    http_proxy_exit();
+    http_file_exit();
+    http_cache_exit();
+    http_log_exit();
+    http_stats_exit();
     pr_info("module unloaded\n");
 }
 
@@ -7,10 +7,10 @@ if [ "$EUID" -eq 0 ]
   exit
 fi
 
-# load kHTTPd
+# load kHTTPd, with the module parameters given to this script if any
 sudo rmmod -f khttpd 2>/dev/null
 sleep 1
-sudo insmod $KHTTPD_MOD
+sudo insmod $KHTTPD_MOD "$@"
 
 # run HTTP benchmarking
 ./htstress -n 100000 -c 1 -t 4 http://localhost:8081/fib/250